@@ -0,0 +1,109 @@
+// Standalone benchmark for frustum_culler.h, needs no window or GL context.
+// Usage: ./bench_culling [sphereCount ...]
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "frustum_culler.h"
+
+using namespace std;
+
+// Camera at the origin looking down -Z, same field of view as the game camera.
+void BuildFrustumPlanes(float* planes, float fovYDegrees, float aspect, float near, float far){
+    auto halfY = fovYDegrees * 0.5f * 3.14159265f / 180.0f;
+    auto halfX = atan(tan(halfY) * aspect);
+
+    float values[6][4] = {
+        {  cos(halfX), 0.0f, -sin(halfX), 0.0f }, // left
+        { -cos(halfX), 0.0f, -sin(halfX), 0.0f }, // right
+        { 0.0f,  cos(halfY), -sin(halfY), 0.0f }, // bottom
+        { 0.0f, -cos(halfY), -sin(halfY), 0.0f }, // top
+        { 0.0f, 0.0f, -1.0f, -near },             // near
+        { 0.0f, 0.0f,  1.0f,  far },              // far
+    };
+
+    for(int i = 0; i < 24; i++){
+        planes[i] = values[i / 4][i % 4];
+    }
+}
+
+void FillRandomSpheres(SphereSoA& spheres, int count){
+    mt19937 gen(1234);
+    uniform_real_distribution<float> position(-1000.0f, 1000.0f);
+    uniform_real_distribution<float> radius(1.0f, 10.0f);
+
+    spheres.Clear();
+    spheres.Reserve(count);
+    for(int i = 0; i < count; i++){
+        spheres.Add(position(gen), position(gen), position(gen), radius(gen));
+    }
+}
+
+double MeasureMicroseconds(CullKernel kernel, const float* planes, const SphereSoA& spheres, int* visibleIndices, int& visibleCount){
+    using Clock = chrono::steady_clock;
+
+    // Repeat until at least ~200ms have passed to get stable numbers on small inputs
+    auto iterations = 0;
+    auto begin = Clock::now();
+    auto elapsed = 0.0;
+
+    do {
+        visibleCount = CullSpheres(kernel, planes, spheres, visibleIndices);
+        iterations++;
+        elapsed = chrono::duration<double, micro>(Clock::now() - begin).count();
+    } while(elapsed < 200000.0);
+
+    return elapsed / iterations;
+}
+
+int main(int argc, char** argv){
+    vector<int> counts;
+    for(int i = 1; i < argc; i++){
+        counts.push_back(atoi(argv[i]));
+    }
+    if(counts.empty()){
+        counts = { 1000, 10000, 100000, 1000000 };
+    }
+
+    float planes[24];
+    BuildFrustumPlanes(planes, 60.0f, 16.0f / 9.0f, 0.1f, 1000.0f);
+
+    CullKernel kernels[] = { CullKernelScalar, CullKernelSSE, CullKernelAVX2 };
+    SphereSoA spheres;
+
+    for(auto count : counts){
+        FillRandomSpheres(spheres, count);
+        vector<int> reference(count);
+        vector<int> visibleIndices(count);
+        auto referenceCount = CullSpheresScalar(planes, spheres, reference.data());
+
+        for(auto kernel : kernels){
+            if(!IsCullKernelSupported(kernel)){
+                printf("%8d spheres  %-6s  not supported on this CPU\n", count, GetCullKernelName(kernel));
+                continue;
+            }
+
+            int visibleCount;
+            auto microseconds = MeasureMicroseconds(kernel, planes, spheres, visibleIndices.data(), visibleCount);
+
+            auto matches = visibleCount == referenceCount;
+            for(int i = 0; matches && i < visibleCount; i++){
+                matches = visibleIndices[i] == reference[i];
+            }
+
+            printf("%8d spheres  %-6s  visible %7d  %10.2f us/pass  %8.1f objects/us  %s\n",
+                   count, GetCullKernelName(kernel), visibleCount, microseconds, count / microseconds,
+                   matches ? "ok" : "MISMATCH");
+
+            if(!matches){
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
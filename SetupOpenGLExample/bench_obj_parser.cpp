@@ -0,0 +1,215 @@
+// Standalone benchmark for obj_parser.h, needs no window or GL context.
+// Compares it with the previous getline/stringstream parser, single and multithreaded, and checks they
+// all produce the same mesh. Also times UnifyObjVertices on the result.
+// Usage: ./bench_obj_parser [file.obj ...]
+// Without arguments a grid mesh in the same "f v//n" layout as the scene meshes is generated, plus a
+// copy that uses negative (relative) face indices, which has to parse to the same mesh.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "obj_parser.h"
+
+using namespace std;
+
+// The parser ParseObj used before obj_parser.h, kept here as the baseline.
+bool ParseObjStringStream(const string& fileName, ObjData& result){
+    fstream file(fileName.c_str(), std::ios::in);
+    if(!file.is_open()){
+        return false;
+    }
+
+    string curLine;
+    while(getline(file, curLine)){
+        stringstream str(curLine);
+        float c1, c2, c3;
+        string tmp;
+
+        if(curLine.length() < 2){
+            continue;
+        }
+
+        if(curLine[0] == 'v'){
+            if(curLine[1] == 't'){
+                str >> tmp >> c1 >> c2;
+                result.textures.push_back(Texture(c1, c2));
+            }
+            else if(curLine[1] == 'n'){
+                str >> tmp >> c1 >> c2 >> c3;
+                result.normals.push_back(Normal(c1, c2, c3));
+            }
+            else{
+                str >> tmp >> c1 >> c2 >> c3;
+                result.vertices.push_back(Vertex(c1, c2, c3));
+            }
+        }
+        else if(curLine[0] == 'f'){
+            str >> tmp;
+            char c;
+            int vIndex[3], nIndex[3], tIndex[3] = { 0, 0, 0 };
+            for(int i = 0; i < 3; i++){
+                str >> vIndex[i] >> c >> c >> nIndex[i];
+                vIndex[i] -= 1;
+                nIndex[i] -= 1;
+                tIndex[i] -= 1;
+            }
+            result.faces.push_back(Face(vIndex, tIndex, nIndex));
+        }
+    }
+
+    return true;
+}
+
+// relative: every row of faces follows its vertices and refers to them with negative indices
+string WriteGridObj(int gridSize, bool relative){
+    auto path = string(relative ? "/tmp/bench_obj_parser_grid_relative.obj" : "/tmp/bench_obj_parser_grid.obj");
+    auto file = fopen(path.c_str(), "w");
+    if(file == nullptr){
+        printf("Cannot write %s\n", path.c_str());
+        exit(1);
+    }
+
+    auto writeRow = [&](int y){
+        for(int x = 0; x <= gridSize; x++){
+            auto h = 0.25f * sinf(x * 0.37f) * cosf(y * 0.21f);
+            fprintf(file, "v %f %f %f\n", x / (float)gridSize - 0.5f, h, y / (float)gridSize - 0.5f);
+            fprintf(file, "vn %f %f %f\n", 0.0f, 1.0f, 0.0f);
+        }
+    };
+    
+    // Faces between row y and y + 1, count is the number of vertices written so far
+    auto writeFaces = [&](int y, int count){
+        for(int x = 0; x < gridSize; x++){
+            auto i = y * (gridSize + 1) + x + 1;
+            auto j = i + gridSize + 1;
+            int corners[6] = { i, j, i + 1, i + 1, j, j + 1 };
+            
+            for(int c = 0; c < 6; c++){
+                if(relative){
+                    corners[c] -= count + 1;
+                }
+            }
+            
+            fprintf(file, "f %d//%d %d//%d %d//%d\n", corners[0], corners[0], corners[1], corners[1], corners[2], corners[2]);
+            fprintf(file, "f %d//%d %d//%d %d//%d\n", corners[3], corners[3], corners[4], corners[4], corners[5], corners[5]);
+        }
+    };
+    
+    writeRow(0);
+    for(int y = 0; y < gridSize; y++){
+        writeRow(y + 1);
+        writeFaces(y, (y + 2) * (gridSize + 1));
+    }
+
+    fclose(file);
+    return path;
+}
+
+bool SameMesh(const ObjData& a, const ObjData& b){
+    if(a.vertices.size() != b.vertices.size() || a.normals.size() != b.normals.size() || a.faces.size() != b.faces.size()){
+        return false;
+    }
+
+    // The scanners may differ from strtof in the last bit
+    auto close = [](float x, float y){ return fabsf(x - y) <= 1e-6f * fmaxf(1.0f, fabsf(x)); };
+
+    for(size_t i = 0; i < a.vertices.size(); i++){
+        if(!close(a.vertices[i].x, b.vertices[i].x) || !close(a.vertices[i].y, b.vertices[i].y) || !close(a.vertices[i].z, b.vertices[i].z)){
+            return false;
+        }
+    }
+    for(size_t i = 0; i < a.normals.size(); i++){
+        if(!close(a.normals[i].x, b.normals[i].x) || !close(a.normals[i].y, b.normals[i].y) || !close(a.normals[i].z, b.normals[i].z)){
+            return false;
+        }
+    }
+    for(size_t i = 0; i < a.faces.size(); i++){
+        for(int c = 0; c < 3; c++){
+            if(a.faces[i].vIndex[c] != b.faces[i].vIndex[c] || a.faces[i].nIndex[c] != b.faces[i].nIndex[c]){
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+template<typename ParseFunction>
+double MeasureMilliseconds(ParseFunction parse, const string& path, ObjData& result){
+    using Clock = chrono::steady_clock;
+
+    // Best of 3, the first run also warms the page cache
+    auto best = 1e30;
+    for(int i = 0; i < 3; i++){
+        result = ObjData();
+        auto begin = Clock::now();
+        if(!parse(path, result)){
+            printf("Failed to parse %s\n", path.c_str());
+            exit(1);
+        }
+        best = min(best, chrono::duration<double, milli>(Clock::now() - begin).count());
+    }
+
+    return best;
+}
+
+int main(int argc, char** argv){
+    vector<string> paths;
+    for(int i = 1; i < argc; i++){
+        paths.push_back(argv[i]);
+    }
+
+    auto singleThread = [](const string& path, ObjData& result){ return ParseObjFile(path, result, 1); };
+    auto allThreads = [](const string& path, ObjData& result){ return ParseObjFile(path, result, 0); };
+    auto threadCount = thread::hardware_concurrency();
+
+    if(paths.empty()){
+        paths.push_back(WriteGridObj(700, false));
+
+        // The stringstream parser doesn't support negative indices, compare with the absolute grid instead
+        auto relativePath = WriteGridObj(700, true);
+        ObjData absolute, relative;
+        ParseObjFile(paths[0], absolute, 1);
+        auto relativeMs = MeasureMilliseconds(allThreads, relativePath, relative);
+        auto matches = SameMesh(absolute, relative);
+        printf("%s\n  obj_parser x%-2u %9.2f ms  %s\n", relativePath.c_str(), threadCount, relativeMs, matches ? "ok" : "MISMATCH");
+
+        if(!matches){
+            return 1;
+        }
+    }
+
+    for(const auto& path : paths){
+        ObjData baseline, single, multi;
+        auto baselineMs = MeasureMilliseconds(ParseObjStringStream, path, baseline);
+        auto singleMs = MeasureMilliseconds(singleThread, path, single);
+        auto multiMs = MeasureMilliseconds(allThreads, path, multi);
+        auto matches = SameMesh(baseline, single) && SameMesh(single, multi);
+
+        printf("%s\n  %zu vertices, %zu faces\n  stringstream    %9.2f ms\n  obj_parser x1   %9.2f ms  (%.1fx)\n  obj_parser x%-2u  %9.2f ms  (%.1fx)  %s\n",
+               path.c_str(), single.vertices.size(), single.faces.size(), baselineMs,
+               singleMs, baselineMs / singleMs, threadCount, multiMs, baselineMs / multiMs,
+               matches ? "ok" : "MISMATCH");
+
+        if(!matches){
+            return 1;
+        }
+
+        ObjData unified;
+        auto begin = chrono::steady_clock::now();
+        if(!UnifyObjVertices(single, unified)){
+            printf("  UnifyObjVertices failed\n");
+            return 1;
+        }
+        auto unifyMs = chrono::duration<double, milli>(chrono::steady_clock::now() - begin).count();
+        printf("  unify           %9.2f ms  (%zu vertices)\n", unifyMs, unified.vertices.size());
+    }
+
+    return 0;
+}
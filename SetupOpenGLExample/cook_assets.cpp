@@ -0,0 +1,193 @@
+// Offline asset cooker, needs no window or GL context.
+// Converts every .obj and .jpg/.png of a directory into the binary formats the game loads directly:
+// meshes with deduplicated vertices, optimized index order (mesh_optimizer.h), a LOD chain (mesh_simplifier.h)
+// and bounds (mesh_cache.h), and textures with their full mip chain (texture_cache.h). The cooked files are
+// written next to the sources and are skipped while they are up to date. Assets are cooked in parallel on all cores.
+// Meshes use the quantized vertex layout unless --float is given.
+// Usage: ./cook_assets [--force] [--float] [directory]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+#include "mesh_cache.h"
+#include "texture_cache.h"
+
+using namespace std;
+
+enum AssetType {
+    AssetMesh,
+    AssetTexture,
+};
+
+struct Asset {
+    string sourcePath;
+    string cookedPath;
+    AssetType type;
+};
+
+bool HasExtension(const string& name, const string& extension){
+    if(name.size() < extension.size()){
+        return false;
+    }
+
+    auto end = name.substr(name.size() - extension.size());
+    transform(end.begin(), end.end(), end.begin(), [](char c){ return (char)tolower(c); });
+    return end == extension;
+}
+
+vector<Asset> FindAssets(const string& directory){
+    vector<Asset> assets;
+    auto dir = opendir(directory.c_str());
+    if(dir == nullptr){
+        return assets;
+    }
+
+    while(auto entry = readdir(dir)){
+        string name = entry->d_name;
+        auto path = directory + "/" + name;
+
+        if(HasExtension(name, ".obj")){
+            assets.push_back(Asset{ path, GetMeshCachePath(path), AssetMesh });
+        }
+        else if(HasExtension(name, ".jpg") || HasExtension(name, ".jpeg") || HasExtension(name, ".png")){
+            assets.push_back(Asset{ path, GetTextureCachePath(path), AssetTexture });
+        }
+    }
+    closedir(dir);
+
+    // Largest first, so the longest jobs don't end up last on a single thread
+    sort(assets.begin(), assets.end(), [](const Asset& a, const Asset& b){
+        MeshCacheKey keyA, keyB;
+        GetMeshCacheKey(a.sourcePath, keyA);
+        GetMeshCacheKey(b.sourcePath, keyB);
+        return keyA.size > keyB.size;
+    });
+    return assets;
+}
+
+bool IsUpToDate(const Asset& asset, const MeshCacheKey& key){
+    MappedFile cooked;
+    if(!cooked.Open(asset.cookedPath)){
+        return false;
+    }
+
+    if(asset.type == AssetMesh){
+        MeshCacheView view;
+        return ReadMeshCache(cooked.data, cooked.size, key, view);
+    }
+
+    TextureCacheView view;
+    return ReadTextureCache(cooked.data, cooked.size, key, view);
+}
+
+bool CookTexture(const string& sourcePath, const MeshCacheKey& key, vector<char>& image){
+    // stbi_set_flip_vertically_on_load is global, use the thread safe variant
+    stbi_set_flip_vertically_on_load_thread(true);
+
+    int width, height, channels;
+    auto pixels = stbi_load(sourcePath.c_str(), &width, &height, &channels, 0);
+    if(pixels == nullptr){
+        return false;
+    }
+
+    auto built = BuildTextureCache(pixels, width, height, channels, key, image);
+    stbi_image_free(pixels);
+    return built;
+}
+
+int main(int argc, char** argv){
+    string directory = ".";
+    auto force = false;
+    auto quantize = true;
+
+    for(int i = 1; i < argc; i++){
+        string argument = argv[i];
+        if(argument == "--force"){
+            force = true;
+        }
+        else if(argument == "--float"){
+            quantize = false;
+        }
+        else{
+            directory = argument;
+        }
+    }
+
+    auto assets = FindAssets(directory);
+    if(assets.empty()){
+        printf("No .obj, .jpg or .png files in %s\n", directory.c_str());
+        return 0;
+    }
+
+    using Clock = chrono::steady_clock;
+    auto begin = Clock::now();
+    atomic<size_t> next(0);
+    atomic<int> failed(0);
+    mutex printMutex;
+
+    auto worker = [&](){
+        vector<char> image;
+
+        for(auto i = next++; i < assets.size(); i = next++){
+            auto& asset = assets[i];
+            auto assetBegin = Clock::now();
+            MeshCacheKey key;
+            VertexCacheStats sourceStats;
+            const char* result;
+
+            if(!GetMeshCacheKey(asset.sourcePath, key)){
+                result = "cannot read";
+            }
+            else if(!force && IsUpToDate(asset, key)){
+                result = "up to date";
+            }
+            else{
+                // The assets already keep every core busy, each one is parsed on a single thread
+                auto cooked = asset.type == AssetMesh ? CookMesh(asset.sourcePath, key, image, 1, quantize, &sourceStats) : CookTexture(asset.sourcePath, key, image);
+                result = !cooked ? "cannot parse" : WriteCacheImage(asset.cookedPath, image) ? "cooked" : "cannot write";
+            }
+
+            auto ok = strcmp(result, "cooked") == 0 || strcmp(result, "up to date") == 0;
+            if(!ok){
+                failed++;
+            }
+
+            lock_guard<mutex> lock(printMutex);
+            printf("  %-12s %8.2f ms  %s\n", result, chrono::duration<double, milli>(Clock::now() - assetBegin).count(), asset.sourcePath.c_str());
+
+            MeshCacheView view;
+            if(asset.type == AssetMesh && strcmp(result, "cooked") == 0 && ReadMeshCache(image.data(), image.size(), key, view)){
+                printf("               ACMR %.3f -> %.3f, ATVR %.3f -> %.3f\n", sourceStats.acmr, view.header->acmr, sourceStats.atvr, view.header->atvr);
+                printf("               LODs:");
+                for(uint32_t lod = 0; lod < view.header->lodCount; lod++){
+                    printf(" %u tris (error %.2g)", view.header->lods[lod].indexCount / 3, view.header->lods[lod].error);
+                }
+                printf("\n");
+            }
+        }
+    };
+
+    auto threadCount = max(1u, min(thread::hardware_concurrency(), (unsigned int)assets.size()));
+    vector<thread> threads;
+    for(unsigned int i = 1; i < threadCount; i++){
+        threads.emplace_back(worker);
+    }
+    worker();
+    for(auto& thread : threads){
+        thread.join();
+    }
+
+    printf("%zu assets on %u threads in %.2f ms, %d failed\n", assets.size(), threadCount,
+           chrono::duration<double, milli>(Clock::now() - begin).count(), failed.load());
+    return failed > 0 ? 1 : 0;
+}
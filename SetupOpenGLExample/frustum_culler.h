@@ -0,0 +1,197 @@
+#pragma once
+
+// Batch frustum culling of bounding spheres stored as structure-of-arrays.
+// Has no GL/GLM dependency so it can be benchmarked standalone (see bench_culling.cpp).
+//
+// Planes are 6 x (nx, ny, nz, d) with normals pointing inside the frustum, a sphere is
+// visible when dot(n, center) + d >= -radius for all 6 planes.
+
+#include <cstddef>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FRUSTUM_CULLER_X86 1
+#include <immintrin.h>
+#endif
+
+struct SphereSoA {
+    std::vector<float> centerX;
+    std::vector<float> centerY;
+    std::vector<float> centerZ;
+    std::vector<float> radius;
+
+    size_t Size() const {
+        return radius.size();
+    }
+
+    void Clear(){
+        centerX.clear();
+        centerY.clear();
+        centerZ.clear();
+        radius.clear();
+    }
+
+    void Reserve(size_t count){
+        centerX.reserve(count);
+        centerY.reserve(count);
+        centerZ.reserve(count);
+        radius.reserve(count);
+    }
+
+    void Add(float x, float y, float z, float r){
+        centerX.push_back(x);
+        centerY.push_back(y);
+        centerZ.push_back(z);
+        radius.push_back(r);
+    }
+};
+
+enum CullKernel {
+    CullKernelScalar,
+    CullKernelSSE,
+    CullKernelAVX2,
+};
+
+inline const char* GetCullKernelName(CullKernel kernel){
+    switch(kernel){
+        case CullKernelSSE: return "SSE";
+        case CullKernelAVX2: return "AVX2";
+        default: return "Scalar";
+    }
+}
+
+// All Cull* functions write the indices of the visible spheres to visibleIndices (which must hold
+// spheres.Size() entries) in increasing order and return how many were written.
+
+inline int CullSpheresScalarRange(const float* planes, const SphereSoA& spheres, size_t begin, int* visibleIndices){
+    auto count = 0;
+
+    for(size_t i = begin; i < spheres.Size(); i++){
+        auto x = spheres.centerX[i];
+        auto y = spheres.centerY[i];
+        auto z = spheres.centerZ[i];
+        auto negRadius = -spheres.radius[i];
+        auto visible = true;
+
+        for(int p = 0; p < 6; p++){
+            const float* plane = planes + p * 4;
+            auto distance = plane[0] * x + plane[1] * y + plane[2] * z + plane[3];
+            visible &= distance >= negRadius;
+        }
+
+        // Branchless compaction, the slot is overwritten by the next sphere if this one is culled
+        visibleIndices[count] = (int)i;
+        count += visible;
+    }
+
+    return count;
+}
+
+inline int CullSpheresScalar(const float* planes, const SphereSoA& spheres, int* visibleIndices){
+    return CullSpheresScalarRange(planes, spheres, 0, visibleIndices);
+}
+
+#ifdef FRUSTUM_CULLER_X86
+
+inline int CullSpheresSSE(const float* planes, const SphereSoA& spheres, int* visibleIndices){
+    auto size = spheres.Size();
+    auto simdEnd = size & ~(size_t)3;
+    auto count = 0;
+
+    __m128 planeX[6], planeY[6], planeZ[6], planeD[6];
+    for(int p = 0; p < 6; p++){
+        planeX[p] = _mm_set1_ps(planes[p * 4 + 0]);
+        planeY[p] = _mm_set1_ps(planes[p * 4 + 1]);
+        planeZ[p] = _mm_set1_ps(planes[p * 4 + 2]);
+        planeD[p] = _mm_set1_ps(planes[p * 4 + 3]);
+    }
+
+    for(size_t i = 0; i < simdEnd; i += 4){
+        auto x = _mm_loadu_ps(&spheres.centerX[i]);
+        auto y = _mm_loadu_ps(&spheres.centerY[i]);
+        auto z = _mm_loadu_ps(&spheres.centerZ[i]);
+        auto negRadius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(&spheres.radius[i]));
+        auto inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+
+        for(int p = 0; p < 6; p++){
+            auto distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(planeX[p], x), _mm_mul_ps(planeY[p], y)),
+                                       _mm_add_ps(_mm_mul_ps(planeZ[p], z), planeD[p]));
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, negRadius));
+        }
+
+        auto mask = _mm_movemask_ps(inside);
+        for(int lane = 0; lane < 4; lane++){
+            visibleIndices[count] = (int)i + lane;
+            count += (mask >> lane) & 1;
+        }
+    }
+
+    return count + CullSpheresScalarRange(planes, spheres, simdEnd, visibleIndices + count);
+}
+
+__attribute__((target("avx2,fma")))
+inline int CullSpheresAVX2(const float* planes, const SphereSoA& spheres, int* visibleIndices){
+    auto size = spheres.Size();
+    auto simdEnd = size & ~(size_t)7;
+    auto count = 0;
+
+    __m256 planeX[6], planeY[6], planeZ[6], planeD[6];
+    for(int p = 0; p < 6; p++){
+        planeX[p] = _mm256_set1_ps(planes[p * 4 + 0]);
+        planeY[p] = _mm256_set1_ps(planes[p * 4 + 1]);
+        planeZ[p] = _mm256_set1_ps(planes[p * 4 + 2]);
+        planeD[p] = _mm256_set1_ps(planes[p * 4 + 3]);
+    }
+
+    for(size_t i = 0; i < simdEnd; i += 8){
+        auto x = _mm256_loadu_ps(&spheres.centerX[i]);
+        auto y = _mm256_loadu_ps(&spheres.centerY[i]);
+        auto z = _mm256_loadu_ps(&spheres.centerZ[i]);
+        auto negRadius = _mm256_sub_ps(_mm256_setzero_ps(), _mm256_loadu_ps(&spheres.radius[i]));
+        auto inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+
+        for(int p = 0; p < 6; p++){
+            auto distance = _mm256_fmadd_ps(planeX[p], x, _mm256_fmadd_ps(planeY[p], y, _mm256_fmadd_ps(planeZ[p], z, planeD[p])));
+            inside = _mm256_and_ps(inside, _mm256_cmp_ps(distance, negRadius, _CMP_GE_OQ));
+        }
+
+        auto mask = _mm256_movemask_ps(inside);
+        for(int lane = 0; lane < 8; lane++){
+            visibleIndices[count] = (int)i + lane;
+            count += (mask >> lane) & 1;
+        }
+    }
+
+    return count + CullSpheresScalarRange(planes, spheres, simdEnd, visibleIndices + count);
+}
+
+#endif
+
+inline bool IsCullKernelSupported(CullKernel kernel){
+#ifdef FRUSTUM_CULLER_X86
+    if(kernel == CullKernelAVX2){
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    }
+    return true;
+#else
+    return kernel == CullKernelScalar;
+#endif
+}
+
+inline CullKernel GetBestCullKernel(){
+    if(IsCullKernelSupported(CullKernelAVX2))
+        return CullKernelAVX2;
+    if(IsCullKernelSupported(CullKernelSSE))
+        return CullKernelSSE;
+    return CullKernelScalar;
+}
+
+inline int CullSpheres(CullKernel kernel, const float* planes, const SphereSoA& spheres, int* visibleIndices){
+#ifdef FRUSTUM_CULLER_X86
+    if(kernel == CullKernelAVX2)
+        return CullSpheresAVX2(planes, spheres, visibleIndices);
+    if(kernel == CullKernelSSE)
+        return CullSpheresSSE(planes, spheres, visibleIndices);
+#endif
+    return CullSpheresScalar(planes, spheres, visibleIndices);
+}
@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <cstddef>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -6,6 +8,7 @@
 #include <iostream>
 #include <sstream>
 #include <vector>
+#include <unordered_map>
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 #include <glm/glm.hpp>
@@ -18,46 +21,17 @@
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
+#include "frustum_culler.h"
+#include "occlusion_culler.h"
+#include "obj_parser.h"
+#include "mesh_cache.h"
+#include "texture_cache.h"
 
 using namespace std;
 using namespace glm;
 
 #define BUFFER_OFFSET(i) ((char*)NULL + (i))
 
-struct Vertex
-{
-    Vertex(GLfloat inX, GLfloat inY, GLfloat inZ) : x(inX), y(inY), z(inZ) { }
-    GLfloat x, y, z;
-};
-
-struct Texture
-{
-    Texture(GLfloat inU, GLfloat inV) : u(inU), v(inV) { }
-    GLfloat u, v;
-};
-
-struct Normal
-{
-    Normal(GLfloat inX, GLfloat inY, GLfloat inZ) : x(inX), y(inY), z(inZ) { }
-    GLfloat x, y, z;
-};
-
-struct Face
-{
-    Face(int v[], int t[], int n[]) {
-        vIndex[0] = v[0];
-        vIndex[1] = v[1];
-        vIndex[2] = v[2];
-        tIndex[0] = t[0];
-        tIndex[1] = t[1];
-        tIndex[2] = t[2];
-        nIndex[0] = n[0];
-        nIndex[1] = n[1];
-        nIndex[2] = n[2];
-    }
-    GLuint vIndex[3], tIndex[3], nIndex[3];
-};
-
 struct Time {
     float time;
     float deltaTime;
@@ -90,6 +64,48 @@ struct Transform{
     }
 };
 
+struct AABB {
+    vec3 min = vec3(0, 0, 0);
+    vec3 max = vec3(0, 0, 0);
+    
+    vec3 Center() const {
+        return (min + max) * 0.5f;
+    }
+    
+    vec3 Extents() const {
+        return (max - min) * 0.5f;
+    }
+    
+    // Arvo's method, bounds of the transformed box without transforming all 8 corners
+    AABB Transformed(const mat4& matrix) const {
+        AABB result;
+        result.min = vec3(matrix[3]);
+        result.max = vec3(matrix[3]);
+        
+        for(int col = 0; col < 3; col++){
+            for(int row = 0; row < 3; row++){
+                auto a = matrix[col][row] * min[col];
+                auto b = matrix[col][row] * max[col];
+                result.min[row] += glm::min(a, b);
+                result.max[row] += glm::max(a, b);
+            }
+        }
+        
+        return result;
+    }
+    
+    void Encapsulate(const AABB& other){
+        min = glm::min(min, other.min);
+        max = glm::max(max, other.max);
+    }
+};
+
+// Planes are stored as (normal, distance) with normals pointing inside: left, right, bottom, top, near, far.
+// The layout matches what the frustum_culler.h kernels expect (6 x 4 floats).
+struct Frustum {
+    vec4 planes[6];
+};
+
 struct Screen{
     int width = 800;
     int height = 600;
@@ -102,7 +118,9 @@ struct Camera{
     vec3 up = vec3(0, 1, 0);
     
     float fovYDegrees = 60.0f;
-    float near = 0.0001f;
+    // Depth resolution behind the near plane falls off with near / d^2, the compact gbuffer rebuilds positions
+    // from the 24 bit depth: 0.1 keeps the error at about 6e-7 * d^2 (6 mm at 100 m, where 1e-4 gave 6 m)
+    float near = 0.1f;
     float far = 10000.0f;
     Screen screen;
     
@@ -116,32 +134,154 @@ struct Camera{
         float aspect = screen.width / (float)screen.height;
         return perspective(fovYRadians, aspect, near, far);
     }
+    
+    // Gribb-Hartmann plane extraction from the rows of projection * view
+    Frustum GetFrustum(){
+        auto m = GetProjectionMatrix() * GetViewingMatrix();
+        vec4 rows[4];
+        for(int i = 0; i < 4; i++){
+            rows[i] = vec4(m[0][i], m[1][i], m[2][i], m[3][i]);
+        }
+        
+        Frustum frustum;
+        frustum.planes[0] = rows[3] + rows[0];
+        frustum.planes[1] = rows[3] - rows[0];
+        frustum.planes[2] = rows[3] + rows[1];
+        frustum.planes[3] = rows[3] - rows[1];
+        frustum.planes[4] = rows[3] + rows[2];
+        frustum.planes[5] = rows[3] - rows[2];
+        
+        for(int i = 0; i < 6; i++){
+            frustum.planes[i] = frustum.planes[i] / length(vec3(frustum.planes[i]));
+        }
+        
+        return frustum;
+    }
+};
+
+// Typed uniform handles, the location is resolved once when the program is linked.
+// glUniform* ignores location -1, so a handle for a uniform the program doesn't use is a no-op.
+struct UniformMat4 {
+    GLint location = -1;
+    
+    void Set(const mat4& value) const {
+        glUniformMatrix4fv(location, 1, GL_FALSE, glm::value_ptr(value));
+    }
+};
+
+struct UniformVec3 {
+    GLint location = -1;
+    
+    void Set(const vec3& value) const {
+        glUniform3fv(location, 1, glm::value_ptr(value));
+    }
+};
+
+struct UniformFloat {
+    GLint location = -1;
+    
+    void Set(float value) const {
+        glUniform1f(location, value);
+    }
+};
+
+struct UniformInt {
+    GLint location = -1;
+    
+    void Set(int value) const {
+        glUniform1i(location, value);
+    }
+};
+
+struct UniformVec4Array {
+    GLint location = -1;
+    
+    void Set(const vec4* values, int count) const {
+        glUniform4fv(location, count, glm::value_ptr(values[0]));
+    }
+};
+
+struct UniformInfo {
+    GLint location;
+    GLenum type;
+    GLint size;
+};
+
+struct ShaderUniforms {
+    UniformMat4 model;
+    UniformVec3 unlit;
+    UniformInt gPosition;
+    UniformInt gDepth;
+    UniformInt gNormal;
+    UniformInt gAlbedoSpec;
+    UniformInt ourTexture;
+    UniformInt tileLightGrid;
+    UniformInt tileLightIndices;
+    UniformInt tileSize;
+    UniformInt tilesX;
+    UniformInt clusterLightGrid;
+    UniformInt clusterLightIndices;
+    UniformInt lightPositions;
+    UniformInt lightIntensities;
+    UniformFloat volumeScale;
+    UniformInt lightOffset;
+    UniformVec3 positionScale;
+    UniformVec3 positionOffset;
+    UniformInt recordCount;
+    UniformInt cullingEnabled;
+    UniformVec4Array frustumPlanes;
+    UniformFloat lodErrorScale;
+    UniformFloat cameraNear;
+    UniformInt hiZSource;
 };
 
 struct Shader {
     int programId;
+    
+    // Every active uniform of the program, reflected at link time. Array uniforms are stored without the "[0]" suffix.
+    unordered_map<string, UniformInfo> activeUniforms;
+    ShaderUniforms uniforms;
+    
+    GLint GetUniformLocation(const string& name) const {
+        auto it = activeUniforms.find(name);
+        return it != activeUniforms.end() ? it->second.location : -1;
+    }
+};
+
+// Index range of one level of detail, all levels share the mesh's vertices.
+// firstIndex is absolute in the index buffer of the mesh's geometry arena.
+struct MeshLod {
+    int firstIndex;
+    int indexCount;
+    // Object space simplification error, see MeshLodLevel
+    float error;
 };
 
 struct Mesh {
     string path;
-    vector<Vertex> vertices;
-    vector<Normal> normals;
-    vector<Texture> textures;
-    vector<Face> faces;
-    GLuint gVertexAttribBuffer;
-    GLuint gIndexBuffer;
-    int gVertexDataSizeInBytes;
-    int gNormalDataSizeInBytes;
-    int vbo;
-    int vao;
-    Shader forwardShader;
-    Shader deferredShader;
+    // Geometry lives in geometryArenas[arenaIndex], its vertices start at baseVertex
+    int arenaIndex;
+    int baseVertex;
+    // lods[0] is the full detail mesh
+    vector<MeshLod> lods;
+    // Position decoding of the vertex layout, see SetMeshUniforms
+    vec3 positionScale;
+    vec3 positionOffset;
+    // Object space bounds, from the mesh cache header
+    AABB bounds;
+    // Globals like forwardGeometryShader, not copies: a Shader carries its reflected uniform map
+    const Shader* forwardShader;
+    const Shader* deferredShader;
 };
 
 struct Object {
     string name;
     Transform transform;
     vector<int> meshIndices;
+    // Union of the mesh bounds in world space, updated every frame in UpdateWorldBounds
+    AABB worldBounds;
+    // The transform never changes after creation, GPU culling uploads it only once
+    bool isStatic = false;
 };
 
 struct Enemy {
@@ -168,19 +308,51 @@ struct Input {
     int jump;
 };
 
+// Lights are considered to have no influence where I / d^2 falls below this, which gives every light
+// a finite radius that the tiled/clustered lighting can bin with and the light volumes can be sized with.
+// Adjusted at runtime with [ and ].
+float lightCutoffIntensity = 0.05f;
+
+// Distance at which the brightest channel of the light falls below lightCutoffIntensity.
+// The brightest channel is used instead of the luminance so saturated lights are not cut off early.
+float GetLightRadius(vec3 intensity){
+    auto maxIntensity = glm::max(intensity.x, glm::max(intensity.y, intensity.z));
+    return sqrt(maxIntensity / lightCutoffIntensity);
+}
+
 struct Scene {
     vector<Object> objects;
     vector<Object> lightObjects;
     vector<Mesh> meshes;
     
-    static constexpr int maxLightCount = 256;
-    vec3 lightPos[maxLightCount];
-    vec3 lightIntensity[maxLightCount];
-    vec3 ligthVelocity[maxLightCount];
-    int lightObjIndex[maxLightCount];
-    bool lightHitGround[maxLightCount];
+    // One entry per light in each array, grown by AddLight
+    vector<vec3> lightPos;
+    vector<vec3> lightIntensity;
+    // Influence radius, derived from the intensity and lightCutoffIntensity (see GetLightRadius)
+    vector<float> lightRadius;
+    vector<vec3> ligthVelocity;
+    vector<int> lightObjIndex;
+    vector<unsigned char> lightHitGround;
+    
+    int lightCount = 0;
+    
+    int AddLight(vec3 pos, vec3 intensity, vec3 velocity, int objIndex){
+        lightPos.push_back(pos);
+        lightIntensity.push_back(intensity);
+        lightRadius.push_back(GetLightRadius(intensity));
+        ligthVelocity.push_back(velocity);
+        lightObjIndex.push_back(objIndex);
+        lightHitGround.push_back(false);
+        
+        return lightCount++;
+    }
     
-    int lightCount;
+    // Called when lightCutoffIntensity changes, the light buffers pick the new radii up on the next frame.
+    void UpdateLightRadii(){
+        for(int i = 0; i < lightCount; i++){
+            lightRadius[i] = GetLightRadius(lightIntensity[i]);
+        }
+    }
 };
 
 vector<Enemy> enemies;
@@ -191,20 +363,110 @@ Input input;
 Time gameTime;
 int wireframeMode = 0;
 int renderDeferred = 0;
+// Size of the default framebuffer in pixels, camera.screen is in screen coordinates which differ on HiDPI displays
+int framebufferWidth = 0;
+int framebufferHeight = 0;
+int renderInstanced = 0;
+// Multi-draw indirect submission, takes precedence over renderInstanced when the context supports it
+int renderIndirect = 0;
+bool multiDrawIndirectSupported = false;
+// Culling, LOD selection and indirect commands in a compute shader, takes precedence over the other modes
+int gpuCulling = 0;
+bool gpuCullingSupported = false;
+// Hi-Z occlusion culling of the deferred geometry pass, see DrawSceneObjectsOccluded
+int occlusionCulling = 0;
+// Result of the last occlusion test of every object, the first phase draws the visible ones
+vector<unsigned char> objectVisibleLastFrame;
+int cullingEnabled = 1;
+int lodEnabled = 1;
+// Largest simplification error SelectLod lets through, in pixels
+float lodMaxPixelError = 1.0f;
+// Triangles submitted this frame, for the frame log
+int64_t drawnTriangleCount = 0;
+// Compact gbuffer: no position target (reconstructed from depth) and octahedral RG16F normals, 8 instead of 20 bytes/pixel
+int compactGBuffer = 0;
+
+enum DeferredLightingMode {
+    DeferredLightingFullScreen, // every pixel loops over all lights
+    DeferredLightingTiled,      // every pixel loops over the lights binned into its screen tile
+    DeferredLightingVolumes,    // every light shades the pixels covered by its sphere volume, blended additively
+    DeferredLightingStencilVolumes, // like Volumes, but a stencil pass first marks the pixels whose surface is inside the sphere
+    DeferredLightingModeCount,
+};
+
+int deferredLightingMode = DeferredLightingTiled;
+
+// Mesh index of sphere.obj, drawn instanced as one volume per light in DeferredLightingVolumes
+int lightVolumeMesh = -1;
+
+enum ForwardLightingMode {
+    ForwardLightingAllLights, // every fragment loops over all lights
+    ForwardLightingClustered, // every fragment loops over the lights assigned to its cluster (froxel)
+    ForwardLightingModeCount,
+};
+
+int forwardLightingMode = ForwardLightingClustered;
+
+const char* GetDeferredLightingModeName(int mode){
+    switch(mode){
+        case DeferredLightingFullScreen: return "FullScreen";
+        case DeferredLightingTiled: return "Tiled";
+        case DeferredLightingVolumes: return "Volumes";
+        case DeferredLightingStencilVolumes: return "StencilVolumes";
+        default: return "Unknown";
+    }
+}
+
+const char* GetForwardLightingModeName(int mode){
+    switch(mode){
+        case ForwardLightingAllLights: return "AllLights";
+        case ForwardLightingClustered: return "Clustered";
+        default: return "Unknown";
+    }
+}
 bool firstFrame = true;
 random_device rd;
 mt19937 gen(rd());
 bool simulationPaused = false;
 
 Shader deferredLightShader;
+Shader deferredTiledLightShader;
+Shader deferredLightVolumeShader;
+Shader deferredLightVolumeStencilShader;
 Shader deferredGeometryShader;
 Shader forwardGeometryShader;
 Shader lightMeshShader;
 Shader forwardGroundShader;
 // Shader deferredGroundShader;
+Shader forwardInstancedShader;
+Shader deferredInstancedShader;
+// INDIRECT_DRAW variants of the instanced shaders, see DrawObjectsIndirect
+Shader forwardIndirectShader;
+Shader deferredIndirectShader;
+// Frustum culling and LOD selection of DrawObjectsGpuCulled
+Shader cullComputeShader;
+// One level of the Hi-Z pyramid, see BuildHiZ
+Shader hiZReduceShader;
+
+// COMPACT_GBUFFER variants of the shaders that write or read the gbuffer, keyed by the program id of the regular shader
+unordered_map<int, Shader> compactGBufferShaders;
+
+// Shaders without a compact variant are returned as is
+const Shader& GetGBufferShader(const Shader& shader){
+    if(compactGBuffer){
+        auto it = compactGBufferShaders.find(shader.programId);
+        if(it != compactGBufferShaders.end()){
+            return it->second;
+        }
+    }
+    
+    return shader;
+}
 
 const float intensityMin = 5.0f;
 const float intensityMax = 100.0f;
+const float lightCutoffIntensityMin = 0.005f;
+const float lightCutoffIntensityMax = 1.0f;
 const float enemySpeed = 5.0f;
 const int enemyCount = 20;
 
@@ -248,137 +510,6 @@ string GetPath(string originalPath){
     // return originalPath;
 }
 
-bool ParseObj(const string& fileName, Mesh& result)
-{
-    fstream myfile;
-    
-    // Open the input
-    myfile.open(fileName.c_str(), std::ios::in);
-    
-    if (myfile.is_open())
-    {
-        string curLine;
-        
-        while (getline(myfile, curLine))
-        {
-            stringstream str(curLine);
-            GLfloat c1, c2, c3;
-            GLuint index[9];
-            string tmp;
-            
-            if (curLine.length() >= 2)
-            {
-                if (curLine[0] == 'v')
-                {
-                    if (curLine[1] == 't') // texture
-                    {
-                        str >> tmp; // consume "vt"
-                        str >> c1 >> c2;
-                        result.textures.push_back(Texture(c1, c2));
-                    }
-                    else if (curLine[1] == 'n') // normal
-                    {
-                        str >> tmp; // consume "vn"
-                        str >> c1 >> c2 >> c3;
-                        result.normals.push_back(Normal(c1, c2, c3));
-                    }
-                    else // vertex
-                    {
-                        str >> tmp; // consume "v"
-                        str >> c1 >> c2 >> c3;
-                        result.vertices.push_back(Vertex(c1, c2, c3));
-                    }
-                }
-                else if (curLine[0] == 'f') // face
-                {
-                    str >> tmp; // consume "f"
-                    char c;
-                    int vIndex[3], nIndex[3], tIndex[3];
-                    str >> vIndex[0]; str >> c >> c; // consume "//"
-                    str >> nIndex[0];
-                    str >> vIndex[1]; str >> c >> c; // consume "//"
-                    str >> nIndex[1];
-                    str >> vIndex[2]; str >> c >> c; // consume "//"
-                    str >> nIndex[2];
-                    
-                    // assert(vIndex[0] == nIndex[0] &&
-                           // vIndex[1] == nIndex[1] &&
-                           // vIndex[2] == nIndex[2]); // a limitation for now
-                    
-                    // make indices start from 0
-                    for (int c = 0; c < 3; ++c)
-                    {
-                        vIndex[c] -= 1;
-                        nIndex[c] -= 1;
-                        tIndex[c] -= 1;
-                    }
-                    
-                    result.faces.push_back(Face(vIndex, tIndex, nIndex));
-                }
-                else
-                {
-                    // cout << "Ignoring unidentified line in obj file: " << curLine << endl;
-                }
-            }
-            
-            //data += curLine;
-            if (!myfile.eof())
-            {
-                //data += "\n";
-            }
-        }
-        
-        myfile.close();
-    }
-    else
-    {
-        return false;
-    }
-    
-    /*
-     for (int i = 0; i < gVertices.size(); ++i)
-     {
-     Vector3 n;
-     
-     for (int j = 0; j < gFaces.size(); ++j)
-     {
-     for (int k = 0; k < 3; ++k)
-     {
-     if (gFaces[j].vIndex[k] == i)
-     {
-     // face j contains vertex i
-     Vector3 a(gVertices[gFaces[j].vIndex[0]].x,
-     gVertices[gFaces[j].vIndex[0]].y,
-     gVertices[gFaces[j].vIndex[0]].z);
-     
-     Vector3 b(gVertices[gFaces[j].vIndex[1]].x,
-     gVertices[gFaces[j].vIndex[1]].y,
-     gVertices[gFaces[j].vIndex[1]].z);
-     
-     Vector3 c(gVertices[gFaces[j].vIndex[2]].x,
-     gVertices[gFaces[j].vIndex[2]].y,
-     gVertices[gFaces[j].vIndex[2]].z);
-     
-     Vector3 ab = b - a;
-     Vector3 ac = c - a;
-     Vector3 normalFromThisFace = (ab.cross(ac)).getNormalized();
-     n += normalFromThisFace;
-     }
-     
-     }
-     }
-     
-     n.normalize();
-     
-     gNormals.push_back(Normal(n.x, n.y, n.z));
-     }
-     */
-    
-    // assert(result.vertices.size() == result.normals.size());
-    
-    return true;
-}
-
 // Add m_ prefix to math methods that I've written over GLM
 float m_lerp(float a, float b, float t){
     return (1.0f - t) * a + b * t;
@@ -400,12 +531,18 @@ void SetWindowTitle(GLFWwindow* window){
 }
 
 void InitGlew(){
-    // Initialize GLEW to setup the OpenGL Function pointers
+    // Initialize GLEW to setup the OpenGL Function pointers, experimental is needed for core profiles on older GLEW versions
+    glewExperimental = GL_TRUE;
     if (GLEW_OK != glewInit())
     {
         std::cout << "Failed to initialize GLEW" << std::endl;
         exit(-1);
     }
+    
+    // The context is requested as 4.1 but may be newer. The commands need baseInstance for the per-draw data.
+    multiDrawIndirectSupported = GLEW_VERSION_4_3 || (GLEW_ARB_multi_draw_indirect && GLEW_ARB_base_instance);
+    // comp_cull.glsl is #version 430 for compute shaders and shader storage buffers
+    gpuCullingSupported = GLEW_VERSION_4_3;
 }
 
 GLFWwindow* CreateWindow(){
@@ -419,6 +556,9 @@ void AddWindowHints(){
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
     glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+    // The stencil light volumes need a stencil buffer in the default framebuffer
+    glfwWindowHint(GLFW_DEPTH_BITS, 24);
+    glfwWindowHint(GLFW_STENCIL_BITS, 8);
 }
 
 void printGLError()
@@ -431,141 +571,363 @@ void printGLError()
 }
 
 
-void InitVBO(Mesh& mesh){
+// One vertex buffer and one index buffer shared by every mesh with the same vertex format. Meshes are
+// appended ranges drawn with a base vertex and an index offset, so a single vao per format describes them
+// all and switching meshes doesn't rebind any buffer.
+struct GeometryArena {
+    uint32_t stride;
+    uint32_t attributeCount;
+    MeshCacheAttribute attributes[meshCacheMaxAttributes];
     GLuint vao;
-    glGenVertexArrays(1, &vao);
-    mesh.vao = vao;
-    assert(mesh.vao > 0);
-    glBindVertexArray(mesh.vao);
+    // Same geometry, with the per-instance attributes of the indirect path (indirectInstanceBuffer)
+    GLuint indirectVao;
+    GLuint vertexBuffer;
+    GLuint indexBuffer;
+    // Per-instance model matrices of the instanced path, refilled for every batch in DrawInstanceBatch
+    GLuint instanceBuffer;
+    GLsizeiptr vertexCapacity;
+    GLsizeiptr vertexBytes;
+    GLsizeiptr indexCapacity;
+    GLsizeiptr indexBytes;
+    
+    bool HasFormat(const MeshCacheHeader& header) const {
+        if(header.attributeCount != attributeCount || GetMeshCacheStride(header) != stride){
+            return false;
+        }
+        return memcmp(header.attributes, attributes, attributeCount * sizeof(MeshCacheAttribute)) == 0;
+    }
+};
+
+vector<GeometryArena> geometryArenas;
+// Arenas grow by doubling, starting at this size
+const GLsizeiptr geometryArenaMinCapacity = 1 << 20;
+
+// Per-instance data of the indirect path. One call mixes meshes, so the position decoding of the mesh
+// (see SetMeshUniforms) comes with the instance instead of a uniform.
+struct IndirectInstance {
+    mat4 model;
+    vec4 positionScale;
+    vec4 positionOffset;
+};
+
+// Filled every frame by DrawObjectsIndirect or DrawObjectsGpuCulled, shared by all arenas
+GLuint indirectInstanceBuffer;
+GLuint indirectCommandBuffer;
+GLsizeiptr indirectInstanceBufferSize = 0;
+GLsizeiptr indirectCommandBufferSize = 0;
+
+void InitIndirectBuffers(){
+    glGenBuffers(1, &indirectInstanceBuffer);
+    glGenBuffers(1, &indirectCommandBuffer);
+    assert(indirectInstanceBuffer > 0 && indirectCommandBuffer > 0);
+}
+
+// Binds the arena's buffers and vertex format to the currently bound vao
+void SetGeometryArenaAttributes(const GeometryArena& arena){
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, arena.indexBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, arena.vertexBuffer);
     
-    glEnableVertexAttribArray(0);
-    glEnableVertexAttribArray(1);
-    printGLError();
+    for(uint32_t i = 0; i < arena.attributeCount; i++){
+        auto& attribute = arena.attributes[i];
+        glEnableVertexAttribArray(attribute.location);
+        glVertexAttribPointer(attribute.location, attribute.components, attribute.type, attribute.normalized ? GL_TRUE : GL_FALSE,
+                              attribute.stride, BUFFER_OFFSET(attribute.offset));
+    }
+}
+
+// Points the vaos at the current buffers of the arena, needed again whenever a buffer is reallocated
+void BindGeometryArenaBuffers(const GeometryArena& arena){
+    glBindVertexArray(arena.vao);
+    SetGeometryArenaAttributes(arena);
+    
+    // A mat4 attribute takes 4 locations (2, 3, 4, 5), non-instanced shaders simply don't read these
+    glBindBuffer(GL_ARRAY_BUFFER, arena.instanceBuffer);
+    for(int i = 0; i < 4; i++){
+        glEnableVertexAttribArray(2 + i);
+        glVertexAttribPointer(2 + i, 4, GL_FLOAT, GL_FALSE, sizeof(mat4), BUFFER_OFFSET(i * sizeof(vec4)));
+        glVertexAttribDivisor(2 + i, 1);
+    }
     
-    glGenBuffers(1, &mesh.gVertexAttribBuffer);
-    glGenBuffers(1, &mesh.gIndexBuffer);
+    // The indirect commands select their instances with baseInstance, which offsets these attributes
+    glBindVertexArray(arena.indirectVao);
+    SetGeometryArenaAttributes(arena);
     
-    assert(mesh.gVertexAttribBuffer > 0 && mesh.gIndexBuffer > 0);
+    glBindBuffer(GL_ARRAY_BUFFER, indirectInstanceBuffer);
+    for(int i = 0; i < 4; i++){
+        glEnableVertexAttribArray(2 + i);
+        glVertexAttribPointer(2 + i, 4, GL_FLOAT, GL_FALSE, sizeof(IndirectInstance), BUFFER_OFFSET(offsetof(IndirectInstance, model) + i * sizeof(vec4)));
+        glVertexAttribDivisor(2 + i, 1);
+    }
+    glEnableVertexAttribArray(6);
+    glVertexAttribPointer(6, 3, GL_FLOAT, GL_FALSE, sizeof(IndirectInstance), BUFFER_OFFSET(offsetof(IndirectInstance, positionScale)));
+    glVertexAttribDivisor(6, 1);
+    glEnableVertexAttribArray(7);
+    glVertexAttribPointer(7, 3, GL_FLOAT, GL_FALSE, sizeof(IndirectInstance), BUFFER_OFFSET(offsetof(IndirectInstance, positionOffset)));
+    glVertexAttribDivisor(7, 1);
+}
+
+// Makes room for requiredBytes, keeping the usedBytes already uploaded. Returns true when buffer was replaced.
+bool ReserveArenaBuffer(GLuint& buffer, GLsizeiptr& capacity, GLsizeiptr usedBytes, GLsizeiptr requiredBytes){
+    if(requiredBytes <= capacity){
+        return false;
+    }
     
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.gVertexAttribBuffer);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.gIndexBuffer);
+    auto newCapacity = std::max(std::max(capacity * 2, requiredBytes), geometryArenaMinCapacity);
+    GLuint newBuffer;
+    glGenBuffers(1, &newBuffer);
+    assert(newBuffer > 0);
+    
+    // The copy targets leave the vao's element array binding alone
+    glBindBuffer(GL_COPY_WRITE_BUFFER, newBuffer);
+    glBufferData(GL_COPY_WRITE_BUFFER, newCapacity, NULL, GL_STATIC_DRAW);
+    if(buffer != 0){
+        glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, usedBytes);
+        glDeleteBuffers(1, &buffer);
+    }
     
-    mesh.gVertexDataSizeInBytes = mesh.vertices.size() * 3 * sizeof(GLfloat);
-    mesh.gNormalDataSizeInBytes = mesh.normals.size() * 3 * sizeof(GLfloat);
-    int indexDataSizeInBytes = mesh.faces.size() * 3 * sizeof(GLuint);
-    GLfloat* vertexData = new GLfloat[mesh.vertices.size() * 3];
-    GLfloat* normalData = new GLfloat[mesh.normals.size() * 3];
-    GLuint* indexData = new GLuint[mesh.faces.size() * 3];
+    buffer = newBuffer;
+    capacity = newCapacity;
+    return true;
+}
+
+int GetGeometryArena(const MeshCacheHeader& header){
+    for(int i = 0; i < geometryArenas.size(); i++){
+        if(geometryArenas[i].HasFormat(header)){
+            return i;
+        }
+    }
     
-    float minX = 1e6, maxX = -1e6;
-    float minY = 1e6, maxY = -1e6;
-    float minZ = 1e6, maxZ = -1e6;
+    auto arena = GeometryArena();
+    arena.stride = GetMeshCacheStride(header);
+    arena.attributeCount = header.attributeCount;
+    memcpy(arena.attributes, header.attributes, sizeof(arena.attributes));
     
-    auto& vertices = mesh.vertices;
+    glGenVertexArrays(1, &arena.vao);
+    glGenVertexArrays(1, &arena.indirectVao);
+    glGenBuffers(1, &arena.instanceBuffer);
+    assert(arena.vao > 0 && arena.indirectVao > 0 && arena.instanceBuffer > 0);
     
-    for (int i = 0; i < vertices.size(); ++i)
-    {
-        vertexData[3 * i] = vertices[i].x;
-        vertexData[3 * i + 1] = vertices[i].y;
-        vertexData[3 * i + 2] = vertices[i].z;
-        
-        minX = std::min(minX, vertices[i].x);
-        maxX = std::max(maxX, vertices[i].x);
-        minY = std::min(minY, vertices[i].y);
-        maxY = std::max(maxY, vertices[i].y);
-        minZ = std::min(minZ, vertices[i].z);
-        maxZ = std::max(maxZ, vertices[i].z);
-    }
+    glBindBuffer(GL_ARRAY_BUFFER, arena.instanceBuffer);
+    auto identity = mat4(1.0f);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(mat4), glm::value_ptr(identity), GL_STREAM_DRAW);
     
-    // std::cout << "minX = " << minX << std::endl;
-    // std::cout << "maxX = " << maxX << std::endl;
-    // std::cout << "minY = " << minY << std::endl;
-    // std::cout << "maxY = " << maxY << std::endl;
-    // std::cout << "minZ = " << minZ << std::endl;
-    // std::cout << "maxZ = " << maxZ << std::endl;
+    geometryArenas.push_back(arena);
+    return (int)geometryArenas.size() - 1;
+}
+
+void InitVBO(Mesh& mesh, const MeshCacheView& cache){
+    auto& header = *cache.header;
+    assert(header.indexType == GL_UNSIGNED_INT);
     
-    auto& normals = mesh.normals;
+    mesh.arenaIndex = GetGeometryArena(header);
+    auto& arena = geometryArenas[mesh.arenaIndex];
     
-    for (int i = 0; i < normals.size(); ++i)
-    {
-        normalData[3 * i] = normals[i].x;
-        normalData[3 * i + 1] = normals[i].y;
-        normalData[3 * i + 2] = normals[i].z;
+    auto vertexReallocated = ReserveArenaBuffer(arena.vertexBuffer, arena.vertexCapacity, arena.vertexBytes, arena.vertexBytes + header.vertexBytes);
+    auto indexReallocated = ReserveArenaBuffer(arena.indexBuffer, arena.indexCapacity, arena.indexBytes, arena.indexBytes + header.indexBytes);
+    if(vertexReallocated || indexReallocated){
+        BindGeometryArenaBuffers(arena);
     }
     
-    auto& faces = mesh.faces;
+    // The blobs already have the GPU layout, when cache points into the mapped file they go straight to the driver
+    glBindBuffer(GL_COPY_WRITE_BUFFER, arena.vertexBuffer);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, arena.vertexBytes, header.vertexBytes, cache.vertexData);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, arena.indexBuffer);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, arena.indexBytes, header.indexBytes, cache.indexData);
+    printGLError();
+    
+    // The indices stay relative to the mesh, the draws add baseVertex
+    mesh.baseVertex = (int)(arena.vertexBytes / arena.stride);
+    auto firstIndex = (int)(arena.indexBytes / sizeof(GLuint));
+    arena.vertexBytes += header.vertexBytes;
+    arena.indexBytes += header.indexBytes;
     
-    for (int i = 0; i < faces.size(); ++i)
-    {
-        indexData[3 * i] = faces[i].vIndex[0];
-        indexData[3 * i + 1] = faces[i].vIndex[1];
-        indexData[3 * i + 2] = faces[i].vIndex[2];
+    mesh.lods.clear();
+    for(uint32_t i = 0; i < header.lodCount; i++){
+        mesh.lods.push_back(MeshLod{ firstIndex + (int)header.lods[i].firstIndex, (int)header.lods[i].indexCount, header.lods[i].error });
+    }
+    mesh.bounds.min = vec3(header.boundsMin[0], header.boundsMin[1], header.boundsMin[2]);
+    mesh.bounds.max = vec3(header.boundsMax[0], header.boundsMax[1], header.boundsMax[2]);
+    mesh.positionScale = vec3(header.positionScale[0], header.positionScale[1], header.positionScale[2]);
+    mesh.positionOffset = vec3(header.positionOffset[0], header.positionOffset[1], header.positionOffset[2]);
+}
+
+const GeometryArena& GetMeshArena(const Mesh& mesh){
+    return geometryArenas[mesh.arenaIndex];
+}
+
+// Draws one LOD of a mesh, the vao of its arena has to be bound
+void DrawMeshElements(const Mesh& mesh, const MeshLod& lod, int instanceCount){
+    auto indices = BUFFER_OFFSET(lod.firstIndex * sizeof(GLuint));
+    if(instanceCount == 1){
+        glDrawElementsBaseVertex(GL_TRIANGLES, lod.indexCount, GL_UNSIGNED_INT, indices, mesh.baseVertex);
+    }
+    else{
+        glDrawElementsInstancedBaseVertex(GL_TRIANGLES, lod.indexCount, GL_UNSIGNED_INT, indices, instanceCount, mesh.baseVertex);
+    }
+}
+
+// Texture formats of the render targets, targets with the same internal format are interchangeable
+struct RenderTargetFormat {
+    GLenum internalFormat;
+    GLenum format;
+    GLenum type;
+    int bytesPerPixel;
+};
+
+const RenderTargetFormat positionTargetFormat = { GL_RGBA16F, GL_RGBA, GL_FLOAT, 8 };
+const RenderTargetFormat normalTargetFormat = { GL_RGBA16F, GL_RGBA, GL_FLOAT, 8 };
+const RenderTargetFormat compactNormalTargetFormat = { GL_RG16F, GL_RG, GL_FLOAT, 4 };
+const RenderTargetFormat albedoSpecTargetFormat = { GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, 4 };
+// Same format as the default framebuffer so the depth blit is valid
+const RenderTargetFormat depthStencilTargetFormat = { GL_DEPTH24_STENCIL8, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8, 4 };
+
+struct RenderTarget {
+    GLuint texture;
+    RenderTargetFormat format;
+    int width;
+    int height;
+    bool inUse;
+    
+    size_t GetSizeInBytes() const {
+        return (size_t)width * height * format.bytesPerPixel;
     }
+};
+
+// Owns every render target texture. Released targets stay alive and are handed out again, a target of the
+// right format but the wrong size gets new storage instead of a new texture. Nothing is deleted, the pool
+// only ever holds what one gbuffer layout of each kind needs.
+struct RenderTargetPool {
+    vector<RenderTarget> targets;
     
+    GLuint Acquire(const RenderTargetFormat& format, int width, int height){
+        RenderTarget* resizable = nullptr;
+        
+        for(auto& target : targets){
+            if(target.inUse || target.format.internalFormat != format.internalFormat){
+                continue;
+            }
+            
+            if(target.width == width && target.height == height){
+                target.inUse = true;
+                return target.texture;
+            }
+            
+            resizable = &target;
+        }
+        
+        if(resizable == nullptr){
+            targets.push_back(RenderTarget());
+            resizable = &targets.back();
+            resizable->format = format;
+            glGenTextures(1, &resizable->texture);
+            glBindTexture(GL_TEXTURE_2D, resizable->texture);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        }
+        
+        glBindTexture(GL_TEXTURE_2D, resizable->texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, format.internalFormat, width, height, 0, format.format, format.type, NULL);
+        resizable->width = width;
+        resizable->height = height;
+        resizable->inUse = true;
+        return resizable->texture;
+    }
     
-    glBufferData(GL_ARRAY_BUFFER, mesh.gVertexDataSizeInBytes + mesh.gNormalDataSizeInBytes, 0, GL_STATIC_DRAW);
-    glBufferSubData(GL_ARRAY_BUFFER, 0, mesh.gVertexDataSizeInBytes, vertexData);
-    glBufferSubData(GL_ARRAY_BUFFER, mesh.gVertexDataSizeInBytes, mesh.gNormalDataSizeInBytes, normalData);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexDataSizeInBytes, indexData, GL_STATIC_DRAW);
+    // Zero (an attachment the current layout doesn't have) is ignored
+    void Release(GLuint texture){
+        for(auto& target : targets){
+            if(target.texture == texture && texture != 0){
+                target.inUse = false;
+            }
+        }
+    }
     
-    // done copying; can free now
-    delete[] vertexData;
-    delete[] normalData;
-    delete[] indexData;
+    size_t GetSizeInBytes(bool inUseOnly) const {
+        size_t total = 0;
+        for(const auto& target : targets){
+            if(target.inUse || !inUseOnly){
+                total += target.GetSizeInBytes();
+            }
+        }
+        return total;
+    }
     
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(mesh.gVertexDataSizeInBytes));
-}
+    void PrintMemoryUsage() const {
+        auto toMB = 1.0 / (1024.0 * 1024.0);
+        cout << "Render targets: " << targets.size() << " textures, " << GetSizeInBytes(false) * toMB << " MB ("
+             << GetSizeInBytes(true) * toMB << " MB in use)" << endl;
+    }
+};
+
+RenderTargetPool renderTargets;
 
 unsigned int gBuffer;
 unsigned int gPosition;
 unsigned int gNormal;
 unsigned int gAlbedoSpec;
+unsigned int gDepth;
+int gBufferWidth;
+int gBufferHeight;
+int gBufferCompact;
 
+// Creates the gbuffer framebuffer once and (re)attaches targets from the pool when the size or the layout changed.
+// Switching back from forward rendering with nothing changed costs nothing.
 void InitDeferredRendering(){
+    // One gbuffer texel per framebuffer pixel, the framebuffer is larger than the window on HiDPI displays
+    auto width = framebufferWidth;
+    auto height = framebufferHeight;
+    
+    if(gBuffer != 0 && gBufferWidth == width && gBufferHeight == height && gBufferCompact == compactGBuffer){
+        return;
+    }
+    
     cout << "InitDeferredRendering" << endl;
-
-    glGenFramebuffers(1, &gBuffer);
+    
+    if(gBuffer == 0){
+        glGenFramebuffers(1, &gBuffer);
+    }
     glBindFramebuffer(GL_FRAMEBUFFER, gBuffer);
     
-    // TODO: Don't know why do I need to multiply by 2 (?)
-    auto width = camera.screen.width * 2;
-    auto height = camera.screen.height * 2;
-      
-    // - position color buffer
-    glGenTextures(1, &gPosition);
-    glBindTexture(GL_TEXTURE_2D, gPosition);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, width, height, 0, GL_RGBA, GL_FLOAT, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, gPosition, 0);
-      
-    // - normal color buffer
-    glGenTextures(1, &gNormal);
-    glBindTexture(GL_TEXTURE_2D, gNormal);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, width, height, 0, GL_RGBA, GL_FLOAT, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, gNormal, 0);
-      
-    // - color + specular color buffer
-    glGenTextures(1, &gAlbedoSpec);
-    glBindTexture(GL_TEXTURE_2D, gAlbedoSpec);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_2D, gAlbedoSpec, 0);
-      
+    renderTargets.Release(gPosition);
+    renderTargets.Release(gNormal);
+    renderTargets.Release(gAlbedoSpec);
+    renderTargets.Release(gDepth);
+    
+    gBufferWidth = width;
+    gBufferHeight = height;
+    gBufferCompact = compactGBuffer;
+    
+    // The compact layout has no position target (reconstructed from depth) and octahedral encoded normals
+    gPosition = compactGBuffer ? 0 : renderTargets.Acquire(positionTargetFormat, width, height);
+    gNormal = renderTargets.Acquire(compactGBuffer ? compactNormalTargetFormat : normalTargetFormat, width, height);
+    gAlbedoSpec = renderTargets.Acquire(albedoSpecTargetFormat, width, height);
+    gDepth = renderTargets.Acquire(depthStencilTargetFormat, width, height);
+    
+    // Color attachments in shader output order, the unused slot is detached
+    GLuint colorTargets[3];
+    auto colorCount = 0;
+    if(!compactGBuffer){
+        colorTargets[colorCount++] = gPosition;
+    }
+    colorTargets[colorCount++] = gNormal;
+    colorTargets[colorCount++] = gAlbedoSpec;
+    
+    for(int i = 0; i < 3; i++){
+        auto texture = i < colorCount ? colorTargets[i] : 0;
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, GL_TEXTURE_2D, texture, 0);
+    }
+    
     // - tell OpenGL which color attachments we'll use (of this framebuffer) for rendering
     unsigned int attachments[3] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2 };
-    glDrawBuffers(3, attachments);
-    
-    // create and attach depth buffer (renderbuffer)
-    unsigned int rboDepth;
-    glGenRenderbuffers(1, &rboDepth);
-    glBindRenderbuffer(GL_RENDERBUFFER, rboDepth);
-    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, width, height);
-    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, rboDepth);
+    glDrawBuffers(colorCount, attachments);
+    
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, gDepth, 0);
+    
+    auto colorBytesPerPixel = compactGBuffer ? 4 + 4 : 8 + 8 + 4;
+    cout << "GBuffer: " << (compactGBuffer ? "Compact" : "Full") << ", " << colorBytesPerPixel << " bytes/pixel + 4 bytes depth-stencil" << endl;
+    renderTargets.PrintMemoryUsage();
+    
     // finally check if framebuffer is complete
     if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
         std::cout << "Framebuffer not complete!" << std::endl;
@@ -646,39 +1008,123 @@ void OnKeyAction(GLFWwindow* window, int key, int scancode, int action, int mods
             }
         }
     }
-    else if(key == GLFW_KEY_P){
+    else if(key == GLFW_KEY_I){
         if(isPress){
-            simulationPaused = !simulationPaused;
-            
-            if(simulationPaused){
-                glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_NORMAL);
+            renderInstanced = !renderInstanced;
+        }
+    }
+    else if(key == GLFW_KEY_M){
+        if(isPress){
+            if(multiDrawIndirectSupported){
+                renderIndirect = !renderIndirect;
             }
             else{
-                glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+                cout << "Multi-draw indirect needs OpenGL 4.3 or ARB_multi_draw_indirect and ARB_base_instance" << endl;
             }
         }
     }
-}
-
-void OnWindowResized(GLFWwindow* window, int width, int height){
-    glViewport(0, 0, width, height);
-    
-    camera.screen.width = width;
-    camera.screen.height = height;
-}
-
-void RegisterKeyPressEvents(GLFWwindow* window){
-    glfwSetKeyCallback(window, OnKeyAction);
-}
-
-void RegisterWindowResizeEvents(GLFWwindow* window){
-    // https://stackoverflow.com/questions/52730164/what-should-i-pass-to-glfwsetwindowsizecallback
-    // glfwSetWindowSizeCallback(window, OnWindowResized);
-    glfwSetFramebufferSizeCallback(window, OnWindowResized);
-}
-
-bool ReadDataFromFile(
-                      const string& fileName, ///< [in]  Name of the shader file
+    else if(key == GLFW_KEY_U){
+        if(isPress){
+            if(gpuCullingSupported){
+                gpuCulling = !gpuCulling;
+            }
+            else{
+                cout << "GPU culling needs OpenGL 4.3 compute shaders" << endl;
+            }
+        }
+    }
+    else if(key == GLFW_KEY_H){
+        if(isPress){
+            occlusionCulling = !occlusionCulling;
+            // Everything counts as visible until tested again
+            objectVisibleLastFrame.clear();
+        }
+    }
+    else if(key == GLFW_KEY_C){
+        if(isPress){
+            cullingEnabled = !cullingEnabled;
+        }
+    }
+    else if(key == GLFW_KEY_G){
+        if(isPress){
+            compactGBuffer = !compactGBuffer;
+            
+            if(renderDeferred == 1){
+                InitDeferredRendering();
+            }
+        }
+    }
+    else if(key == GLFW_KEY_L){
+        if(isPress){
+            if(renderDeferred){
+                deferredLightingMode = (deferredLightingMode + 1) % DeferredLightingModeCount;
+            }
+            else{
+                forwardLightingMode = (forwardLightingMode + 1) % ForwardLightingModeCount;
+            }
+        }
+    }
+    else if(key == GLFW_KEY_LEFT_BRACKET || key == GLFW_KEY_RIGHT_BRACKET){
+        if(isPress){
+            auto factor = key == GLFW_KEY_RIGHT_BRACKET ? 2.0f : 0.5f;
+            lightCutoffIntensity = glm::clamp(lightCutoffIntensity * factor, lightCutoffIntensityMin, lightCutoffIntensityMax);
+            scene.UpdateLightRadii();
+            cout << "Light cutoff intensity: " << lightCutoffIntensity << endl;
+        }
+    }
+    else if(key == GLFW_KEY_O){
+        if(isPress){
+            lodEnabled = !lodEnabled;
+        }
+    }
+    else if(key == GLFW_KEY_P){
+        if(isPress){
+            simulationPaused = !simulationPaused;
+            
+            if(simulationPaused){
+                glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_NORMAL);
+            }
+            else{
+                glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+            }
+        }
+    }
+}
+
+// Screen coordinates, only the aspect ratio of the camera reads them
+void OnWindowResized(GLFWwindow* window, int width, int height){
+    // Minimized windows report 0x0, which has no aspect ratio
+    if(width > 0 && height > 0){
+        camera.screen.width = width;
+        camera.screen.height = height;
+    }
+}
+
+// Pixels, larger than the window size on HiDPI displays
+void OnFramebufferResized(GLFWwindow* window, int width, int height){
+    glViewport(0, 0, width, height);
+    
+    framebufferWidth = width;
+    framebufferHeight = height;
+    
+    // Minimized windows report 0x0, keep the old gbuffer until there is something to render again
+    if(renderDeferred == 1 && width > 0 && height > 0){
+        InitDeferredRendering();
+    }
+}
+
+void RegisterKeyPressEvents(GLFWwindow* window){
+    glfwSetKeyCallback(window, OnKeyAction);
+}
+
+void RegisterWindowResizeEvents(GLFWwindow* window){
+    // https://stackoverflow.com/questions/52730164/what-should-i-pass-to-glfwsetwindowsizecallback
+    glfwSetWindowSizeCallback(window, OnWindowResized);
+    glfwSetFramebufferSizeCallback(window, OnFramebufferResized);
+}
+
+bool ReadDataFromFile(
+                      const string& fileName, ///< [in]  Name of the shader file
                       string& data)     ///< [out] The contents of the file
 {
     fstream myfile;
@@ -709,7 +1155,24 @@ bool ReadDataFromFile(
     return true;
 }
 
-GLuint CreateShader(const char* name, GLenum shaderType){
+// Declarations every shader shares (the FrameData block, the compact gbuffer encoding), read once
+const string& GetCommonShaderSource(){
+    static string commonSource;
+    if(commonSource.empty()){
+        auto filename = GetPath("shaders/common.glsl");
+        if (!ReadDataFromFile(filename, commonSource))
+        {
+            cout << "Cannot find file name: " + filename << endl;
+            exit(-1);
+        }
+    }
+    
+    return commonSource;
+}
+
+// defines (e.g. "#define COMPACT_GBUFFER\n"), VERTEX_SHADER for vertex shaders and then shaders/common.glsl are
+// inserted after the #version line, #line keeps the compile log in the line numbers of the file
+GLuint CreateShader(const char* name, GLenum shaderType, const string& defines){
     string shaderSource;
     string filename(name);
     
@@ -719,6 +1182,10 @@ GLuint CreateShader(const char* name, GLenum shaderType){
         exit(-1);
     }
     
+    auto versionEnd = shaderSource.find('\n') + 1;
+    auto stageDefines = shaderType == GL_VERTEX_SHADER ? "#define VERTEX_SHADER\n" : "";
+    shaderSource.insert(versionEnd, defines + stageDefines + GetCommonShaderSource() + "\n#line 2\n");
+    
     const char* vertexShaderSource = shaderSource.c_str();
     auto shaderId = glCreateShader(shaderType);
     glShaderSource(shaderId, 1, &vertexShaderSource, NULL);
@@ -737,20 +1204,108 @@ GLuint CreateShader(const char* name, GLenum shaderType){
     return shaderId;
 }
 
-GLuint CreateVertexShader(const char* name){
-    return CreateShader(name, GL_VERTEX_SHADER);
+GLuint CreateVertexShader(const char* name, const string& defines){
+    return CreateShader(name, GL_VERTEX_SHADER, defines);
+}
+
+GLuint CreateFragmentShader(const char* name, const string& defines){
+    return CreateShader(name, GL_FRAGMENT_SHADER, defines);
+}
+
+bool IsSamplerType(GLenum type){
+    return type == GL_SAMPLER_2D || type == GL_SAMPLER_CUBE || type == GL_UNSIGNED_INT_SAMPLER_BUFFER || type == GL_SAMPLER_BUFFER;
+}
+
+template<typename T>
+T ResolveUniform(const Shader& shader, const char* name, GLenum expectedType){
+    T handle;
+    auto it = shader.activeUniforms.find(name);
+    if(it == shader.activeUniforms.end()){
+        return handle;
+    }
+    
+    auto type = it->second.type;
+    auto typeMatches = type == expectedType || (expectedType == GL_INT && IsSamplerType(type));
+    DebugAssert(typeMatches, (string("Uniform type mismatch: ") + name).c_str());
+    handle.location = it->second.location;
+    
+    return handle;
 }
 
-GLuint CreateFragmentShader(const char* name){
-    return CreateShader(name, GL_FRAGMENT_SHADER);
+// Fixed binding points of the uniform blocks shared by all programs (see shaders/*.glsl)
+const GLuint frameDataBinding = 0;
+
+void BindUniformBlock(GLuint programId, const char* blockName, GLuint binding){
+    auto blockIndex = glGetUniformBlockIndex(programId, blockName);
+    if(blockIndex != GL_INVALID_INDEX){
+        glUniformBlockBinding(programId, blockIndex, binding);
+    }
 }
 
-Shader CreateShaderProgram(const char* vertexShaderName, const char* fragmentShaderName){
+void ReflectUniforms(Shader& shader){
+    auto programId = shader.programId;
+    
+    // GLSL 4.10 has no layout(binding = N) for blocks, assign them here
+    BindUniformBlock(programId, "FrameData", frameDataBinding);
+
+    GLint uniformCount = 0;
+    glGetProgramiv(programId, GL_ACTIVE_UNIFORMS, &uniformCount);
+    
+    for(int i = 0; i < uniformCount; i++){
+        char name[256];
+        GLsizei nameLength;
+        UniformInfo info;
+        glGetActiveUniform(programId, i, sizeof(name), &nameLength, &info.size, &info.type, name);
+        info.location = glGetUniformLocation(programId, name);
+        
+        // Uniforms inside blocks have no location, those are not set with glUniform*
+        if(info.location == -1)
+            continue;
+        
+        // "lightPositions[0]" -> "lightPositions"
+        string uniformName(name, nameLength);
+        auto bracket = uniformName.find('[');
+        if(bracket != string::npos){
+            uniformName = uniformName.substr(0, bracket);
+        }
+        
+        shader.activeUniforms[uniformName] = info;
+    }
+    
+    auto& u = shader.uniforms;
+    u.model = ResolveUniform<UniformMat4>(shader, "model", GL_FLOAT_MAT4);
+    u.unlit = ResolveUniform<UniformVec3>(shader, "unlit", GL_FLOAT_VEC3);
+    u.gPosition = ResolveUniform<UniformInt>(shader, "gPosition", GL_INT);
+    u.gDepth = ResolveUniform<UniformInt>(shader, "gDepth", GL_INT);
+    u.gNormal = ResolveUniform<UniformInt>(shader, "gNormal", GL_INT);
+    u.gAlbedoSpec = ResolveUniform<UniformInt>(shader, "gAlbedoSpec", GL_INT);
+    u.ourTexture = ResolveUniform<UniformInt>(shader, "ourTexture", GL_INT);
+    u.tileLightGrid = ResolveUniform<UniformInt>(shader, "tileLightGrid", GL_INT);
+    u.tileLightIndices = ResolveUniform<UniformInt>(shader, "tileLightIndices", GL_INT);
+    u.tileSize = ResolveUniform<UniformInt>(shader, "tileSize", GL_INT);
+    u.tilesX = ResolveUniform<UniformInt>(shader, "tilesX", GL_INT);
+    u.clusterLightGrid = ResolveUniform<UniformInt>(shader, "clusterLightGrid", GL_INT);
+    u.clusterLightIndices = ResolveUniform<UniformInt>(shader, "clusterLightIndices", GL_INT);
+    u.lightPositions = ResolveUniform<UniformInt>(shader, "lightPositions", GL_INT);
+    u.lightIntensities = ResolveUniform<UniformInt>(shader, "lightIntensities", GL_INT);
+    u.volumeScale = ResolveUniform<UniformFloat>(shader, "volumeScale", GL_FLOAT);
+    u.lightOffset = ResolveUniform<UniformInt>(shader, "lightOffset", GL_INT);
+    u.positionScale = ResolveUniform<UniformVec3>(shader, "positionScale", GL_FLOAT_VEC3);
+    u.positionOffset = ResolveUniform<UniformVec3>(shader, "positionOffset", GL_FLOAT_VEC3);
+    u.recordCount = ResolveUniform<UniformInt>(shader, "recordCount", GL_INT);
+    u.cullingEnabled = ResolveUniform<UniformInt>(shader, "cullingEnabled", GL_INT);
+    u.frustumPlanes = ResolveUniform<UniformVec4Array>(shader, "frustumPlanes", GL_FLOAT_VEC4);
+    u.lodErrorScale = ResolveUniform<UniformFloat>(shader, "lodErrorScale", GL_FLOAT);
+    u.cameraNear = ResolveUniform<UniformFloat>(shader, "cameraNear", GL_FLOAT);
+    u.hiZSource = ResolveUniform<UniformInt>(shader, "hiZSource", GL_INT);
+}
+
+Shader CreateShaderProgram(const char* vertexShaderName, const char* fragmentShaderName, const string& defines = ""){
     auto shaderProgramId = glCreateProgram();
     DebugAssert(shaderProgramId != -1, "ShaderProgram Failed.");
     
-    const auto vertexShaderId = CreateVertexShader(vertexShaderName);
-    const auto fragmentShaderId  = CreateFragmentShader(fragmentShaderName);
+    const auto vertexShaderId = CreateVertexShader(vertexShaderName, defines);
+    const auto fragmentShaderId  = CreateFragmentShader(fragmentShaderName, defines);
     
     glAttachShader(shaderProgramId, vertexShaderId);
     glAttachShader(shaderProgramId, fragmentShaderId);
@@ -773,16 +1328,59 @@ Shader CreateShaderProgram(const char* vertexShaderName, const char* fragmentSha
     
     Shader shader;
     shader.programId = shaderProgramId;
+    ReflectUniforms(shader);
+    
+    return shader;
+}
+
+// Also compiles the COMPACT_GBUFFER variant, see GetGBufferShader
+Shader CreateGBufferShaderProgram(const char* vertexShaderName, const char* fragmentShaderName, const string& defines = ""){
+    auto shader = CreateShaderProgram(vertexShaderName, fragmentShaderName, defines);
+    compactGBufferShaders[shader.programId] = CreateShaderProgram(vertexShaderName, fragmentShaderName, defines + "#define COMPACT_GBUFFER\n");
+    return shader;
+}
+
+// Compute programs need OpenGL 4.3, only created when gpuCullingSupported
+Shader CreateComputeShaderProgram(const char* computeShaderName){
+    auto shaderProgramId = glCreateProgram();
+    DebugAssert(shaderProgramId != -1, "ShaderProgram Failed.");
+    
+    const auto computeShaderId = CreateShader(computeShaderName, GL_COMPUTE_SHADER, "");
+    glAttachShader(shaderProgramId, computeShaderId);
+    glLinkProgram(shaderProgramId);
+    GLint success;
+    glGetProgramiv(shaderProgramId, GL_LINK_STATUS, &success);
+    
+    if (!success)
+    {
+        char infoLog[512];
+        glGetProgramInfoLog(shaderProgramId, 512, NULL, infoLog);
+        cout << "Program link failed: " << infoLog << endl;
+        exit(-1);
+    }
+    
+    glDeleteShader(computeShaderId);
+    
+    Shader shader;
+    shader.programId = shaderProgramId;
+    ReflectUniforms(shader);
     
     return shader;
 }
 
+// Meshes may store quantized positions relative to their bounds (see BuildMeshCache), the vertex shaders
+// decode them with these. The float layout has scale 1 and offset 0.
+void SetMeshUniforms(const ShaderUniforms& uniforms, const Mesh& mesh){
+    uniforms.positionScale.Set(mesh.positionScale);
+    uniforms.positionOffset.Set(mesh.positionOffset);
+}
+
 const Mesh& GetMesh(int index){
     return scene.meshes[index];
 }
 
 
-int CreateMesh(const string& objPath, Shader forwardShader, Shader deferredShader){
+int CreateMesh(const string& objPath, const Shader& forwardShader, const Shader& deferredShader){
     auto idx = GetMeshIndex(objPath);
     if(idx != -1){
         return idx;
@@ -790,10 +1388,44 @@ int CreateMesh(const string& objPath, Shader forwardShader, Shader deferredShade
     
     Mesh mesh;
     mesh.path = objPath;
-    assert(ParseObj(GetPath(objPath), mesh));
-    mesh.forwardShader = forwardShader;
-    mesh.deferredShader = deferredShader;
-    InitVBO(mesh);
+    mesh.forwardShader = &forwardShader;
+    mesh.deferredShader = &deferredShader;
+    
+    // Prefer the cooked binary mesh (see mesh_cache.h and cook_assets.cpp), it is mapped and uploaded without parsing.
+    // The OBJ is only cooked here when the cache is missing or stale, and the cache is rewritten then.
+    auto startTime = glfwGetTime();
+    auto sourcePath = GetPath(objPath);
+    auto cachePath = GetMeshCachePath(sourcePath);
+    MeshCacheKey key;
+    MappedFile cacheFile;
+    MeshCacheView cache;
+    vector<char> cacheImage;
+    // The scene can't do without its meshes, a failed load ends the program like a missing shader does
+    if(!GetMeshCacheKey(sourcePath, key)){
+        cout << "Cannot read mesh " << sourcePath << endl;
+        exit(-1);
+    }
+    
+    auto cached = cacheFile.Open(cachePath) && ReadMeshCache(cacheFile.data, cacheFile.size, key, cache);
+    if(!cached){
+        if(!CookMesh(sourcePath, key, cacheImage)){
+            cout << "Cannot parse mesh " << sourcePath << endl;
+            exit(-1);
+        }
+        if(!ReadMeshCache(cacheImage.data(), cacheImage.size(), key, cache)){
+            cout << "Cannot read cooked mesh " << sourcePath << endl;
+            exit(-1);
+        }
+        
+        if(!WriteCacheImage(cachePath, cacheImage)){
+            cout << "Cannot write mesh cache " << cachePath << endl;
+        }
+    }
+    
+    InitVBO(mesh, cache);
+    cout << "Loaded " << objPath << (cached ? " from cache" : "") << " in " << (glfwGetTime() - startTime) * 1000.0 << " ms, "
+         << cache.header->vertexBytes / std::max(cache.header->vertexCount, 1u) << " bytes/vertex, ACMR " << cache.header->acmr
+         << ", ATVR " << cache.header->atvr << ", " << mesh.lods.size() << " LODs" << endl;
     idx = scene.meshes.size();
     scene.meshes.push_back(mesh);
     
@@ -917,24 +1549,44 @@ void InitGround(){
     // set texture filtering parameters
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    // load image, create texture and generate mipmaps
-    int width, height, nrChannels;
-    stbi_set_flip_vertically_on_load(true); // tell stb_image.h to flip loaded texture's on the y-axis.
-    // The FileSystem::getPath(...) is part of the GitHub repository so we can find files on any IDE/platform; replace it with your own image path.
-    unsigned char *data = stbi_load(GetPath("doom-ground.jpg").c_str(), &width, &height, &nrChannels, 0);
-    if (data)
+    // The cooked texture (see texture_cache.h) already has its mipmaps, otherwise decode the jpg and generate them
+    auto texturePath = GetPath("doom-ground.jpg");
+    MeshCacheKey textureKey;
+    MappedFile cookedTexture;
+    TextureCacheView cooked;
+    if(GetMeshCacheKey(texturePath, textureKey) && cookedTexture.Open(GetTextureCachePath(texturePath)) &&
+       ReadTextureCache(cookedTexture.data, cookedTexture.size, textureKey, cooked))
     {
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-        glGenerateMipmap(GL_TEXTURE_2D);
+        const GLenum formats[] = { GL_RED, GL_RG, GL_RGB, GL_RGBA };
+        auto format = formats[cooked.header->channels - 1];
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        for(uint32_t mip = 0; mip < cooked.header->mipCount; mip++){
+            glTexImage2D(GL_TEXTURE_2D, mip, format, cooked.GetMipWidth(mip), cooked.GetMipHeight(mip), 0, format, GL_UNSIGNED_BYTE, cooked.GetMipData(mip));
+        }
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, cooked.header->mipCount - 1);
     }
     else
     {
-        std::cout << "Failed to load texture" << std::endl;
+        // load image, create texture and generate mipmaps
+        int width, height, nrChannels;
+        stbi_set_flip_vertically_on_load(true); // tell stb_image.h to flip loaded texture's on the y-axis.
+        // The FileSystem::getPath(...) is part of the GitHub repository so we can find files on any IDE/platform; replace it with your own image path.
+        unsigned char *data = stbi_load(texturePath.c_str(), &width, &height, &nrChannels, 0);
+        if (data)
+        {
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
+            glGenerateMipmap(GL_TEXTURE_2D);
+        }
+        else
+        {
+            std::cout << "Failed to load texture" << std::endl;
+        }
+        stbi_image_free(data);
     }
-    stbi_image_free(data);
 
     glUseProgram(forwardGroundShader.programId);
-    glUniform1i(glGetUniformLocation(forwardGroundShader.programId, "ourTexture"), 0);
+    forwardGroundShader.uniforms.ourTexture.Set(0);
 }
 
 void CheckError(){
@@ -946,45 +1598,284 @@ void CheckError(){
     }
 }
 
-void UpdateLightDataForShader(Shader shader){
-    auto lightCount = scene.lightCount;
-    auto shaderId = shader.programId;
-    glUseProgram(shaderId);
+struct ScreenRect {
+    int minX, minY, maxX, maxY;
+};
+
+// Conservative pixel rectangle covered by a world space sphere. Returns false when the sphere is
+// entirely behind the camera or outside the screen.
+bool GetSphereScreenRect(const vec3& center, float radius, const mat4& viewingMatrix, const mat4& projectionMatrix, int width, int height, ScreenRect& rect){
+    auto viewCenter = vec3(viewingMatrix * vec4(center, 1.0f));
+    
+    // Camera looks down -Z in view space
+    if(viewCenter.z - radius > -camera.near){
+        return false;
+    }
+    
+    // Crosses the near plane (or contains the camera), projecting the corners is not valid anymore
+    if(viewCenter.z + radius > -camera.near){
+        rect = { 0, 0, width - 1, height - 1 };
+        return true;
+    }
+    
+    auto ndcMin = vec2(1e9f, 1e9f);
+    auto ndcMax = vec2(-1e9f, -1e9f);
+    
+    for(int i = 0; i < 8; i++){
+        auto offset = vec3(i & 1 ? radius : -radius, i & 2 ? radius : -radius, i & 4 ? radius : -radius);
+        auto clip = projectionMatrix * vec4(viewCenter + offset, 1.0f);
+        auto ndc = vec2(clip) / clip.w;
+        ndcMin = glm::min(ndcMin, ndc);
+        ndcMax = glm::max(ndcMax, ndc);
+    }
+    
+    if(ndcMax.x < -1.0f || ndcMin.x > 1.0f || ndcMax.y < -1.0f || ndcMin.y > 1.0f){
+        return false;
+    }
+    
+    // NDC to window coordinates (origin bottom left, same as gl_FragCoord)
+    rect.minX = glm::clamp((int)floor((ndcMin.x * 0.5f + 0.5f) * width), 0, width - 1);
+    rect.maxX = glm::clamp((int)floor((ndcMax.x * 0.5f + 0.5f) * width), 0, width - 1);
+    rect.minY = glm::clamp((int)floor((ndcMin.y * 0.5f + 0.5f) * height), 0, height - 1);
+    rect.maxY = glm::clamp((int)floor((ndcMax.y * 0.5f + 0.5f) * height), 0, height - 1);
+    
+    return true;
+}
+
+// Per screen tile (slices = 1) or per cluster light lists, stored in texture buffers.
+// Used by frag_deferred_light_tiled.glsl and frag_forward.glsl.
+struct LightGrid {
+    int tileSize;
+    // Depth slices, slice 0 covers [camera near, depthNear), the rest split [depthNear, depthFar) exponentially
+    int slices;
+    float depthNear;
+    float depthFar;
+    int tilesX = 0;
+    int tilesY = 0;
+    // (offset, count) into lightIndices for each cell, x fastest, then y (from the bottom), then slice
+    vector<GLuint> cells;
+    vector<GLuint> lightIndices;
+    
+    GLuint cellBuffer;
+    GLuint cellTexture;
+    GLuint indexBuffer;
+    GLuint indexTexture;
+};
+
+LightGrid tileLightGrid = { 16, 1, 0.0f, 0.0f };
+LightGrid clusterLightGrid = { 64, 24, 1.0f, 2000.0f };
+
+// (slices - 1) / log(far / near), the GLSL side gets this through FrameData::clusterDepth
+float GetSliceScale(const LightGrid& grid){
+    return (grid.slices - 1) / log(grid.depthFar / grid.depthNear);
+}
+
+// Must match GetClusterIndex in frag_forward.glsl
+int GetClusterSlice(const LightGrid& grid, float depth){
+    if(grid.slices == 1 || depth < grid.depthNear){
+        return 0;
+    }
+    
+    return glm::min(1 + (int)(log(depth / grid.depthNear) * GetSliceScale(grid)), grid.slices - 1);
+}
+
+void InitLightGrid(LightGrid& grid){
+    glGenBuffers(1, &grid.cellBuffer);
+    glGenTextures(1, &grid.cellTexture);
+    glBindBuffer(GL_TEXTURE_BUFFER, grid.cellBuffer);
+    glBufferData(GL_TEXTURE_BUFFER, 2 * sizeof(GLuint), NULL, GL_STREAM_DRAW);
+    glBindTexture(GL_TEXTURE_BUFFER, grid.cellTexture);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RG32UI, grid.cellBuffer);
+    
+    glGenBuffers(1, &grid.indexBuffer);
+    glGenTextures(1, &grid.indexTexture);
+    glBindBuffer(GL_TEXTURE_BUFFER, grid.indexBuffer);
+    glBufferData(GL_TEXTURE_BUFFER, sizeof(GLuint), NULL, GL_STREAM_DRAW);
+    glBindTexture(GL_TEXTURE_BUFFER, grid.indexTexture);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_R32UI, grid.indexBuffer);
+    CheckError();
+}
+
+struct LightCells {
+    ScreenRect tiles;
+    int minSlice, maxSlice;
+};
 
-    auto lightPosLoc = glGetUniformLocation(shaderId, "lightPositions");
-    assert(lightPosLoc != -1);
-    glUniform3fv(lightPosLoc, lightCount, glm::value_ptr(scene.lightPos[0]));
+void BuildLightGrid(LightGrid& grid, int width, int height){
+    grid.tilesX = (width + grid.tileSize - 1) / grid.tileSize;
+    grid.tilesY = (height + grid.tileSize - 1) / grid.tileSize;
+    auto cellCount = grid.tilesX * grid.tilesY * grid.slices;
+    grid.cells.assign(cellCount * 2, 0);
+    
+    auto projectionMatrix = camera.GetProjectionMatrix();
+    auto viewingMatrix = camera.GetViewingMatrix();
+    
+    // Cell range of every light, tiles.minX = -1 when it doesn't touch the screen
+    vector<LightCells> lightCells(scene.lightCount);
+    
+    for(int i = 0; i < scene.lightCount; i++){
+        auto radius = scene.lightRadius[i];
+        ScreenRect rect;
+        
+        if(!GetSphereScreenRect(scene.lightPos[i], radius, viewingMatrix, projectionMatrix, width, height, rect)){
+            lightCells[i].tiles.minX = -1;
+            continue;
+        }
+        
+        auto& cells = lightCells[i];
+        cells.tiles.minX = rect.minX / grid.tileSize;
+        cells.tiles.maxX = rect.maxX / grid.tileSize;
+        cells.tiles.minY = rect.minY / grid.tileSize;
+        cells.tiles.maxY = rect.maxY / grid.tileSize;
+        
+        auto depth = -(viewingMatrix * vec4(scene.lightPos[i], 1.0f)).z;
+        cells.minSlice = GetClusterSlice(grid, depth - radius);
+        cells.maxSlice = GetClusterSlice(grid, depth + radius);
+        
+        for(int z = cells.minSlice; z <= cells.maxSlice; z++){
+            for(int y = cells.tiles.minY; y <= cells.tiles.maxY; y++){
+                for(int x = cells.tiles.minX; x <= cells.tiles.maxX; x++){
+                    grid.cells[((z * grid.tilesY + y) * grid.tilesX + x) * 2 + 1]++;
+                }
+            }
+        }
+    }
+    
+    // Prefix sum for the offsets, then reset the counts and use them as insert cursors
+    GLuint offset = 0;
+    for(int i = 0; i < cellCount; i++){
+        grid.cells[i * 2] = offset;
+        offset += grid.cells[i * 2 + 1];
+        grid.cells[i * 2 + 1] = 0;
+    }
+    
+    grid.lightIndices.resize(glm::max((int)offset, 1));
+    
+    for(int i = 0; i < scene.lightCount; i++){
+        auto& cells = lightCells[i];
+        if(cells.tiles.minX == -1)
+            continue;
+        
+        for(int z = cells.minSlice; z <= cells.maxSlice; z++){
+            for(int y = cells.tiles.minY; y <= cells.tiles.maxY; y++){
+                for(int x = cells.tiles.minX; x <= cells.tiles.maxX; x++){
+                    auto cell = ((z * grid.tilesY + y) * grid.tilesX + x) * 2;
+                    grid.lightIndices[grid.cells[cell] + grid.cells[cell + 1]++] = i;
+                }
+            }
+        }
+    }
+    
+    glBindBuffer(GL_TEXTURE_BUFFER, grid.cellBuffer);
+    glBufferData(GL_TEXTURE_BUFFER, grid.cells.size() * sizeof(GLuint), grid.cells.data(), GL_STREAM_DRAW);
+    glBindBuffer(GL_TEXTURE_BUFFER, grid.indexBuffer);
+    glBufferData(GL_TEXTURE_BUFFER, grid.lightIndices.size() * sizeof(GLuint), grid.lightIndices.data(), GL_STREAM_DRAW);
     CheckError();
-    auto lightIntensityLoc = glGetUniformLocation(shaderId, "lightIntensities");
-    glUniform3fv(lightIntensityLoc, lightCount, glm::value_ptr(scene.lightIntensity[0]));
+}
+
+// std140 layout of the FrameData block in shaders/common.glsl
+struct FrameData {
+    mat4 projection;
+    mat4 view;
+    mat4 inverseViewProjection;
+    vec3 cameraPos;
+    int clusteredLighting;
+    int clusterGrid[4];
+    float clusterDepth[4];
+    int lightCount;
+    int pad0[3];
+};
+
+GLuint frameDataUbo;
+
+// Texture unit the light buffers are bound to for the whole program lifetime
+const int lightPositionsTextureUnit = 7;
+const int lightIntensitiesTextureUnit = 8;
+
+// GPU copy of the scene lights as texture buffers (RGBA32F, one texel per light).
+// Storage grows by doubling when the light count exceeds the capacity.
+struct LightBuffers {
+    int capacity = 0;
+    vector<vec4> positions; // xyz: position, w: influence radius
+    vector<vec4> intensities;
+    
+    GLuint positionBuffer;
+    GLuint positionTexture;
+    GLuint intensityBuffer;
+    GLuint intensityTexture;
+};
+
+LightBuffers lightBuffers;
+
+void InitLightBuffers(){
+    auto& lights = lightBuffers;
+    lights.capacity = 256;
+    
+    glGenBuffers(1, &lights.positionBuffer);
+    glBindBuffer(GL_TEXTURE_BUFFER, lights.positionBuffer);
+    glBufferData(GL_TEXTURE_BUFFER, lights.capacity * sizeof(vec4), NULL, GL_DYNAMIC_DRAW);
+    glGenTextures(1, &lights.positionTexture);
+    glActiveTexture(GL_TEXTURE0 + lightPositionsTextureUnit);
+    glBindTexture(GL_TEXTURE_BUFFER, lights.positionTexture);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, lights.positionBuffer);
+    
+    glGenBuffers(1, &lights.intensityBuffer);
+    glBindBuffer(GL_TEXTURE_BUFFER, lights.intensityBuffer);
+    glBufferData(GL_TEXTURE_BUFFER, lights.capacity * sizeof(vec4), NULL, GL_DYNAMIC_DRAW);
+    glGenTextures(1, &lights.intensityTexture);
+    glActiveTexture(GL_TEXTURE0 + lightIntensitiesTextureUnit);
+    glBindTexture(GL_TEXTURE_BUFFER, lights.intensityTexture);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, lights.intensityBuffer);
+    
+    glActiveTexture(GL_TEXTURE0);
     CheckError();
-    auto lightCountLoc = glGetUniformLocation(shaderId, "lightCount");
-    glUniform1i(lightCountLoc, scene.lightCount);
+}
+
+void InitUniformBuffers(){
+    FrameData frameData = {};
+    
+    glGenBuffers(1, &frameDataUbo);
+    glBindBuffer(GL_UNIFORM_BUFFER, frameDataUbo);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameData), &frameData, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, frameDataBinding, frameDataUbo);
     CheckError();
 }
 
+void UpdateFrameData(const mat4& projectionMatrix, const mat4& viewingMatrix){
+    FrameData frameData;
+    frameData.projection = projectionMatrix;
+    frameData.view = viewingMatrix;
+    frameData.inverseViewProjection = inverse(projectionMatrix * viewingMatrix);
+    frameData.cameraPos = camera.position;
+    
+    auto& grid = clusterLightGrid;
+    frameData.clusteredLighting = renderDeferred == 0 && forwardLightingMode == ForwardLightingClustered;
+    frameData.clusterGrid[0] = grid.tileSize;
+    frameData.clusterGrid[1] = grid.tilesX;
+    frameData.clusterGrid[2] = grid.tilesY;
+    frameData.clusterGrid[3] = grid.slices;
+    frameData.clusterDepth[0] = grid.depthNear;
+    frameData.clusterDepth[1] = grid.depthFar;
+    frameData.clusterDepth[2] = GetSliceScale(grid);
+    frameData.clusterDepth[3] = 0.0f;
+    frameData.lightCount = scene.lightCount;
+    
+    glBindBuffer(GL_UNIFORM_BUFFER, frameDataUbo);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameData), &frameData);
+}
+
 int GetRenderShader(const Mesh& mesh){
     if(renderDeferred == 0){
         // Forward
-        return mesh.forwardShader.programId;
+        return mesh.forwardShader->programId;
     }
     
-    return mesh.deferredShader.programId;
+    return mesh.deferredShader->programId;
 }
 
 // TODO: Use different shader for lights (not the one used for forward/deferred rendering)
 void CreateLight(vec3 pos, vec3 vel){
-    if(scene.lightCount >= scene.maxLightCount)
-    {
-        cout << "max lights reached." << endl;
-        return;
-    }
-        
-    auto idx = scene.lightCount++;
     auto intensity = RandomVec3(intensityMin, intensityMax);
-    scene.lightPos[idx] = pos;
-    scene.lightIntensity[idx] = intensity;
-    scene.ligthVelocity[idx] = vel;
     
     auto lightObj = Object();
     lightObj.name = "Light";
@@ -995,7 +1886,7 @@ void CreateLight(vec3 pos, vec3 vel){
     auto objIndex = scene.lightObjects.size();
     scene.lightObjects.push_back(lightObj);
     
-    scene.lightObjIndex[idx] = objIndex;    
+    scene.AddLight(pos, intensity, vel, objIndex);
 }
 
 void InitLights(){
@@ -1006,9 +1897,8 @@ void InitLights(){
     for(int i = 0; i < lightCount; i++){
         auto randomPos = RandomVec3(posMin, posMax);
         auto randomIntensity = RandomVec3(intensityMin, intensityMax);
-        auto idx = scene.lightCount++;
-        scene.lightPos[idx] = randomPos;
-        scene.lightIntensity[idx] = randomIntensity;
+        // No light object, these are not drawn
+        scene.AddLight(randomPos, randomIntensity, vec3(0, 0, 0), -1);
     }
 }
 
@@ -1027,6 +1917,7 @@ void InitScene(){
             cube.transform.position = vec3(x * separation, scaleY, z * separation);
             cube.transform.scale = vec3(scaleXZ, scaleY, scaleXZ);
             cube.meshIndices.push_back(CreateMesh("cube.obj", forwardGeometryShader, deferredGeometryShader));
+            cube.isStatic = true;
         
             scene.objects.push_back(cube);
             
@@ -1054,37 +1945,101 @@ void MouseButtonCallback(GLFWwindow* window, int button, int action, int mods) {
     }
 }
 
+// Every sampler has a fixed texture unit, a program that doesn't use a sampler has a -1 location and skips it
+void SetTextureUnits(const Shader& shader){
+    auto& uniforms = shader.uniforms;
+    glUseProgram(shader.programId);
+    
+    // gDepth replaces gPosition in the compact gbuffer layout
+    uniforms.gPosition.Set(0);
+    uniforms.gDepth.Set(0);
+    uniforms.gNormal.Set(1);
+    uniforms.gAlbedoSpec.Set(2);
+    uniforms.tileLightGrid.Set(3);
+    uniforms.tileLightIndices.Set(4);
+    uniforms.clusterLightGrid.Set(5);
+    uniforms.clusterLightIndices.Set(6);
+    uniforms.hiZSource.Set(0);
+    uniforms.lightPositions.Set(lightPositionsTextureUnit);
+    uniforms.lightIntensities.Set(lightIntensitiesTextureUnit);
+    CheckError();
+}
+
 void CreateShaders(){
     forwardGeometryShader = CreateShaderProgram(
                                         GetPath("shaders/vert_forward.glsl").data(),
                                         GetPath("shaders/frag_forward.glsl").data());
     
-    deferredGeometryShader = CreateShaderProgram(
+    deferredGeometryShader = CreateGBufferShaderProgram(
                                         GetPath("shaders/vert_deferred_geometry.glsl").data(),
                                         GetPath("shaders/frag_deferred_geometry.glsl").data());
     
-    deferredLightShader = CreateShaderProgram(
+    deferredLightShader = CreateGBufferShaderProgram(
                                         GetPath("shaders/vert_deferred_light.glsl").data(),
                                         GetPath("shaders/frag_deferred_light.glsl").data());
     
+    deferredTiledLightShader = CreateGBufferShaderProgram(
+                                        GetPath("shaders/vert_deferred_light.glsl").data(),
+                                        GetPath("shaders/frag_deferred_light_tiled.glsl").data());
+    
+    deferredLightVolumeShader = CreateGBufferShaderProgram(
+                                        GetPath("shaders/vert_deferred_light_volume.glsl").data(),
+                                        GetPath("shaders/frag_deferred_light_volume.glsl").data());
+    
+    deferredLightVolumeStencilShader = CreateShaderProgram(
+                                        GetPath("shaders/vert_deferred_light_volume.glsl").data(),
+                                        GetPath("shaders/frag_deferred_light_volume_stencil.glsl").data());
+    
     lightMeshShader = CreateShaderProgram(
                                         GetPath("shaders/vert_lights.glsl").data(),
                                         GetPath("shaders/frag_lights.glsl").data());
     
-    glUseProgram(deferredLightShader.programId);
+    forwardInstancedShader = CreateShaderProgram(
+                                        GetPath("shaders/vert_forward_instanced.glsl").data(),
+                                        GetPath("shaders/frag_forward.glsl").data());
     
-    glUniform1i(glGetUniformLocation(deferredLightShader.programId, "gPosition"), 0);
-    CheckError();
-    glUniform1i(glGetUniformLocation(deferredLightShader.programId, "gNormal"), 1);
-    CheckError();
-    glUniform1i(glGetUniformLocation(deferredLightShader.programId, "gAlbedoSpec"), 2);
-    CheckError();
+    deferredInstancedShader = CreateGBufferShaderProgram(
+                                        GetPath("shaders/vert_deferred_geometry_instanced.glsl").data(),
+                                        GetPath("shaders/frag_deferred_geometry.glsl").data());
+    
+    forwardIndirectShader = CreateShaderProgram(
+                                        GetPath("shaders/vert_forward_instanced.glsl").data(),
+                                        GetPath("shaders/frag_forward.glsl").data(), "#define INDIRECT_DRAW\n");
+    
+    deferredIndirectShader = CreateGBufferShaderProgram(
+                                        GetPath("shaders/vert_deferred_geometry_instanced.glsl").data(),
+                                        GetPath("shaders/frag_deferred_geometry.glsl").data(), "#define INDIRECT_DRAW\n");
+    
+    hiZReduceShader = CreateShaderProgram(
+                                        GetPath("shaders/vert_deferred_light.glsl").data(),
+                                        GetPath("shaders/frag_hiz_reduce.glsl").data());
+    
+    if(gpuCullingSupported){
+        cullComputeShader = CreateComputeShaderProgram(GetPath("shaders/comp_cull.glsl").data());
+    }
+    
+    Shader* shaders[] = { &forwardGeometryShader, &forwardInstancedShader, &forwardIndirectShader, &deferredLightShader, &deferredTiledLightShader, &deferredLightVolumeShader, &deferredLightVolumeStencilShader, &hiZReduceShader };
+    for(auto shader : shaders){
+        SetTextureUnits(*shader);
+    }
+    for(auto& pair : compactGBufferShaders){
+        SetTextureUnits(pair.second);
+    }
 }
 
 void InitProgram(GLFWwindow* window){
     glEnable(GL_DEPTH_TEST);
     
     CreateShaders();
+    InitUniformBuffers();
+    InitLightBuffers();
+    InitLightGrid(tileLightGrid);
+    InitLightGrid(clusterLightGrid);
+    // Before the first mesh, the arenas point their indirect vaos at these
+    InitIndirectBuffers();
+    
+    // Light volumes need the sphere even before the first light is created
+    lightVolumeMesh = CreateMesh("sphere.obj", lightMeshShader, lightMeshShader);
     
     InitPlayer();
     InitGround();
@@ -1099,53 +2054,561 @@ void InitProgram(GLFWwindow* window){
 }
 
 
-void DrawMesh(const mat4& projectionMatrix, const mat4& viewingMatrix, const mat4& modelingMatrix, const Mesh& mesh, const Shader& shader, int lightIndex){
+void ApplyPolygonMode(){
     if(wireframeMode){
         glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
     }
     else{
         glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
     }
+}
+
+// Pixels covered by one world unit at distance 1
+float GetPixelsPerUnit(){
+    return framebufferHeight * 0.5f / tan(radians(camera.fovYDegrees) * 0.5f);
+}
+
+// Coarsest LOD whose simplification error projects to at most lodMaxPixelError pixels, measured at the point of
+// the mesh's bounding sphere closest to the camera
+int SelectLod(const Mesh& mesh, const mat4& modelingMatrix){
+    if(!lodEnabled || mesh.lods.size() < 2){
+        return 0;
+    }
     
-    auto shaderId = shader.programId;
-    glUseProgram(shaderId);
+    auto scale = std::max(length(vec3(modelingMatrix[0])), std::max(length(vec3(modelingMatrix[1])), length(vec3(modelingMatrix[2]))));
+    auto center = vec3(modelingMatrix * vec4(mesh.bounds.Center(), 1.0f));
+    auto radius = length(mesh.bounds.Extents()) * scale;
+    auto distance = std::max(length(center - camera.position) - radius, camera.near);
+    auto pixelsPerUnit = GetPixelsPerUnit();
+    
+    int lod = 0;
+    while(lod + 1 < mesh.lods.size() && mesh.lods[lod + 1].error * scale * pixelsPerUnit / distance <= lodMaxPixelError){
+        lod++;
+    }
+    return lod;
+}
+
+void DrawMesh(const mat4& modelingMatrix, const Mesh& mesh, const Shader& shader, int lightIndex){
+    ApplyPolygonMode();
+    
+    auto& uniforms = shader.uniforms;
+    glUseProgram(shader.programId);
     
     if(lightIndex != -1){
-        auto unlitLoc = glGetUniformLocation(shaderId, "unlit");
-        assert(unlitLoc != -1);
+        assert(uniforms.unlit.location != -1);
         auto norm_intensity = normalize(scene.lightIntensity[lightIndex]);
-        glUniform3fv(unlitLoc, 1, glm::value_ptr(norm_intensity));
+        uniforms.unlit.Set(norm_intensity);
         CheckError();
     }
     
-    glBindVertexArray(mesh.vao);
+    glBindVertexArray(GetMeshArena(mesh).vao);
 
-    glUniformMatrix4fv(glGetUniformLocation(shaderId, "projection"), 1, GL_FALSE, glm::value_ptr(projectionMatrix));
-    CheckError();
-    glUniformMatrix4fv(glGetUniformLocation(shaderId, "view"), 1, GL_FALSE, glm::value_ptr(viewingMatrix));
-    CheckError();
-    glUniformMatrix4fv(glGetUniformLocation(shaderId, "model"), 1, GL_FALSE, glm::value_ptr(modelingMatrix));
-    CheckError();
-    glUniform3fv(glGetUniformLocation(shaderId, "cameraPos"), 1, glm::value_ptr(camera.position));
+    // projection, view and cameraPos come from the FrameData block
+    uniforms.model.Set(modelingMatrix);
+    SetMeshUniforms(uniforms, mesh);
     CheckError();
     
-    // Not sure if these are required after we're doing vao already, a question for later.
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.gVertexAttribBuffer);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.gIndexBuffer);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(mesh.gVertexDataSizeInBytes));
-    
-    glDrawElements(GL_TRIANGLES, mesh.faces.size() * 3, GL_UNSIGNED_INT, 0);
+    // The arena's vao holds the buffers and the attribute layout, see GeometryArena
+    auto& lod = mesh.lods[SelectLod(mesh, modelingMatrix)];
+    DrawMeshElements(mesh, lod, 1);
+    drawnTriangleCount += lod.indexCount / 3;
 }
 
-void DrawObject(const mat4& projectionMatrix, const mat4& viewingMatrix, const Object& obj, bool deferred, int lightIndex) {
+void DrawObject(const Object& obj, bool deferred, int lightIndex) {
     const auto modelingMatrix = obj.transform.GetMatrix();
     
     for(int i = 0; i < obj.meshIndices.size(); i++){
         auto& mesh = GetMesh(obj.meshIndices[i]);
-        auto shader = deferred ? mesh.deferredShader : mesh.forwardShader;
-        DrawMesh(projectionMatrix, viewingMatrix, modelingMatrix, mesh, shader, lightIndex);
+        const auto& shader = deferred ? GetGBufferShader(*mesh.deferredShader) : *mesh.forwardShader;
+        DrawMesh(modelingMatrix, mesh, shader, lightIndex);
+    }
+}
+
+// Indices into scene.objects that survived culling this frame, both draw paths only iterate these.
+vector<int> visibleObjects;
+
+// Bounding spheres of the objects with meshes, cullCandidates[i] is the object index of sphere i.
+SphereSoA cullSpheres;
+vector<int> cullCandidates;
+vector<int> cullResult;
+CullKernel cullKernel = GetBestCullKernel();
+
+void UpdateWorldBounds(){
+    for(int i = 0; i < scene.objects.size(); i++){
+        auto& obj = scene.objects[i];
+        if(obj.meshIndices.empty())
+            continue;
+        
+        auto modelingMatrix = obj.transform.GetMatrix();
+        obj.worldBounds = GetMesh(obj.meshIndices[0]).bounds.Transformed(modelingMatrix);
+        
+        for(int j = 1; j < obj.meshIndices.size(); j++){
+            obj.worldBounds.Encapsulate(GetMesh(obj.meshIndices[j]).bounds.Transformed(modelingMatrix));
+        }
+    }
+}
+
+void CullScene(){
+    UpdateWorldBounds();
+    
+    cullSpheres.Clear();
+    cullCandidates.clear();
+    
+    for(int i = 0; i < scene.objects.size(); i++){
+        const auto& obj = scene.objects[i];
+        
+        // Player has no mesh
+        if(obj.meshIndices.empty())
+            continue;
+        
+        auto center = obj.worldBounds.Center();
+        auto radius = length(obj.worldBounds.Extents());
+        cullSpheres.Add(center.x, center.y, center.z, radius);
+        cullCandidates.push_back(i);
+    }
+    
+    visibleObjects.clear();
+    
+    if(!cullingEnabled){
+        visibleObjects = cullCandidates;
+        return;
+    }
+    
+    auto frustum = camera.GetFrustum();
+    cullResult.resize(cullCandidates.size());
+    auto visibleCount = CullSpheres(cullKernel, glm::value_ptr(frustum.planes[0]), cullSpheres, cullResult.data());
+    
+    for(int i = 0; i < visibleCount; i++){
+        visibleObjects.push_back(cullCandidates[cullResult[i]]);
+    }
+}
+
+// Objects sharing the same Mesh, LOD and (instanced) shader, drawn with a single glDrawElementsInstanced call.
+struct InstanceBatch {
+    int meshIndex;
+    int lod;
+    const Shader* shader;
+    vector<mat4> modelMatrices;
+};
+
+vector<InstanceBatch> instanceBatches;
+
+// Only meshes drawn with the geometry shaders have an instanced variant, the rest (nullptr) go through DrawMesh.
+// indirect picks the INDIRECT_DRAW variant of DrawObjectsIndirect.
+const Shader* GetInstancedShader(const Mesh& mesh, bool deferred, bool indirect){
+    if(deferred){
+        auto& shader = indirect ? deferredIndirectShader : deferredInstancedShader;
+        return mesh.deferredShader == &deferredGeometryShader ? &GetGBufferShader(shader) : nullptr;
+    }
+    
+    auto& shader = indirect ? forwardIndirectShader : forwardInstancedShader;
+    return mesh.forwardShader == &forwardGeometryShader ? &shader : nullptr;
+}
+
+InstanceBatch& GetInstanceBatch(int meshIndex, int lod, const Shader* shader){
+    for(int i = 0; i < instanceBatches.size(); i++){
+        auto& batch = instanceBatches[i];
+        if(batch.meshIndex == meshIndex && batch.lod == lod && batch.shader == shader){
+            return batch;
+        }
+    }
+    
+    auto batch = InstanceBatch();
+    batch.meshIndex = meshIndex;
+    batch.lod = lod;
+    batch.shader = shader;
+    instanceBatches.push_back(batch);
+    
+    return instanceBatches.back();
+}
+
+void DrawInstanceBatch(const InstanceBatch& batch){
+    auto instanceCount = (int)batch.modelMatrices.size();
+    if(instanceCount == 0){
+        return;
+    }
+    
+    ApplyPolygonMode();
+    
+    auto& mesh = GetMesh(batch.meshIndex);
+    glUseProgram(batch.shader->programId);
+    SetMeshUniforms(batch.shader->uniforms, mesh);
+    auto& arena = GetMeshArena(mesh);
+    glBindVertexArray(arena.vao);
+    
+    // Orphan and refill, transforms change every frame (enemies are moving).
+    glBindBuffer(GL_ARRAY_BUFFER, arena.instanceBuffer);
+    glBufferData(GL_ARRAY_BUFFER, instanceCount * sizeof(mat4), batch.modelMatrices.data(), GL_STREAM_DRAW);
+    
+    auto& lod = mesh.lods[batch.lod];
+    DrawMeshElements(mesh, lod, instanceCount);
+    drawnTriangleCount += (int64_t)lod.indexCount / 3 * instanceCount;
+}
+
+// Sorts the visible objects into instanceBatches, meshes without an instanced shader are drawn right away
+void CollectInstanceBatches(bool deferred, bool indirect){
+    // Keep the batches (and their capacity) alive between frames, only reset the instance lists.
+    for(int i = 0; i < instanceBatches.size(); i++){
+        instanceBatches[i].modelMatrices.clear();
+    }
+    
+    for(int i = 0; i < visibleObjects.size(); i++){
+        const auto& obj = scene.objects[visibleObjects[i]];
+        auto modelingMatrix = obj.transform.GetMatrix();
+        
+        for(int j = 0; j < obj.meshIndices.size(); j++){
+            auto meshIndex = obj.meshIndices[j];
+            auto& mesh = GetMesh(meshIndex);
+            auto instancedShader = GetInstancedShader(mesh, deferred, indirect);
+            
+            if(instancedShader == nullptr){
+                const auto& shader = deferred ? GetGBufferShader(*mesh.deferredShader) : *mesh.forwardShader;
+                DrawMesh(modelingMatrix, mesh, shader, -1);
+                continue;
+            }
+            
+            GetInstanceBatch(meshIndex, SelectLod(mesh, modelingMatrix), instancedShader).modelMatrices.push_back(modelingMatrix);
+        }
+    }
+}
+
+void DrawObjectsInstanced(bool deferred){
+    CollectInstanceBatches(deferred, false);
+    
+    for(int i = 0; i < instanceBatches.size(); i++){
+        DrawInstanceBatch(instanceBatches[i]);
+    }
+}
+
+// Layout of the commands glMultiDrawElementsIndirect reads
+struct DrawElementsIndirectCommand {
+    GLuint count;
+    GLuint instanceCount;
+    GLuint firstIndex;
+    GLint baseVertex;
+    GLuint baseInstance;
+};
+
+// Consecutive commands sharing a geometry arena and shader, submitted with one glMultiDrawElementsIndirect call
+struct IndirectBucket {
+    int arenaIndex;
+    const Shader* shader;
+    int firstCommand;
+    int commandCount;
+};
+
+vector<DrawElementsIndirectCommand> indirectCommands;
+vector<IndirectInstance> indirectInstances;
+vector<IndirectBucket> indirectBuckets;
+vector<int> indirectBatchOrder;
+
+// Every instance batch becomes one command, the batches of an arena and shader one call. The GL work per
+// frame is two buffer uploads plus a call per bucket, no matter how many objects and meshes are visible.
+void DrawObjectsIndirect(bool deferred){
+    CollectInstanceBatches(deferred, true);
+    
+    indirectBatchOrder.clear();
+    for(int i = 0; i < instanceBatches.size(); i++){
+        if(!instanceBatches[i].modelMatrices.empty()){
+            indirectBatchOrder.push_back(i);
+        }
+    }
+    sort(indirectBatchOrder.begin(), indirectBatchOrder.end(), [](int a, int b){
+        auto& batchA = instanceBatches[a];
+        auto& batchB = instanceBatches[b];
+        auto arenaA = GetMesh(batchA.meshIndex).arenaIndex;
+        auto arenaB = GetMesh(batchB.meshIndex).arenaIndex;
+        return arenaA != arenaB ? arenaA < arenaB : batchA.shader->programId < batchB.shader->programId;
+    });
+    
+    indirectCommands.clear();
+    indirectInstances.clear();
+    indirectBuckets.clear();
+    
+    for(auto batchIndex : indirectBatchOrder){
+        auto& batch = instanceBatches[batchIndex];
+        auto& mesh = GetMesh(batch.meshIndex);
+        auto& lod = mesh.lods[batch.lod];
+        
+        if(indirectBuckets.empty() || indirectBuckets.back().arenaIndex != mesh.arenaIndex || indirectBuckets.back().shader != batch.shader){
+            indirectBuckets.push_back(IndirectBucket{ mesh.arenaIndex, batch.shader, (int)indirectCommands.size(), 0 });
+        }
+        indirectBuckets.back().commandCount++;
+        
+        auto instanceCount = (GLuint)batch.modelMatrices.size();
+        indirectCommands.push_back(DrawElementsIndirectCommand{ (GLuint)lod.indexCount, instanceCount, (GLuint)lod.firstIndex, mesh.baseVertex, (GLuint)indirectInstances.size() });
+        drawnTriangleCount += (int64_t)lod.indexCount / 3 * instanceCount;
+        
+        auto positionScale = vec4(mesh.positionScale, 0.0f);
+        auto positionOffset = vec4(mesh.positionOffset, 0.0f);
+        for(auto& modelMatrix : batch.modelMatrices){
+            indirectInstances.push_back(IndirectInstance{ modelMatrix, positionScale, positionOffset });
+        }
+    }
+    
+    if(indirectCommands.empty()){
+        return;
+    }
+    
+    // Orphan and refill, like the instance buffers of DrawInstanceBatch
+    indirectInstanceBufferSize = indirectInstances.size() * sizeof(IndirectInstance);
+    indirectCommandBufferSize = indirectCommands.size() * sizeof(DrawElementsIndirectCommand);
+    glBindBuffer(GL_ARRAY_BUFFER, indirectInstanceBuffer);
+    glBufferData(GL_ARRAY_BUFFER, indirectInstanceBufferSize, indirectInstances.data(), GL_STREAM_DRAW);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirectCommandBuffer);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, indirectCommandBufferSize, indirectCommands.data(), GL_STREAM_DRAW);
+    
+    ApplyPolygonMode();
+    
+    for(auto& bucket : indirectBuckets){
+        glUseProgram(bucket.shader->programId);
+        glBindVertexArray(geometryArenas[bucket.arenaIndex].indirectVao);
+        glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, BUFFER_OFFSET(bucket.firstCommand * sizeof(DrawElementsIndirectCommand)), bucket.commandCount, 0);
+    }
+    
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
+
+// Shader storage layouts of comp_cull.glsl (std430)
+struct GpuCullRecord {
+    mat4 model;
+    GLuint meshIndex;
+    GLuint padding[3];
+};
+
+struct GpuCullMesh {
+    vec4 sphere;
+    vec4 lodErrors;
+    vec4 positionScale;
+    vec4 positionOffset;
+    GLuint firstCommand;
+    GLuint lodCount;
+    GLuint padding[2];
+};
+
+// GPU copy of the scene for DrawObjectsGpuCulled: a record per instanced mesh of every object, the bounds and
+// LODs of the meshes, and a command per mesh LOD whose instance range can hold all records of the mesh.
+struct GpuCullScene {
+    GLuint recordBuffer = 0;
+    GLuint meshBuffer = 0;
+    // Commands with instanceCount 0, copied over indirectCommandBuffer before every dispatch
+    GLuint commandTemplateBuffer = 0;
+    // Scene size the buffers were built for, the scene only grows
+    size_t objectCount = 0;
+    size_t meshCount = 0;
+    
+    vector<GpuCullRecord> records;
+    vector<int> recordObjects;
+    // Records of static objects come first, the rest are uploaded every frame
+    int firstDynamicRecord = 0;
+    int commandCount = 0;
+    int instanceCapacity = 0;
+    // Shader is resolved per frame, all records use the instanced geometry shaders
+    vector<IndirectBucket> buckets;
+    // Meshes without an instanced shader, drawn with DrawMesh (not culled)
+    vector<pair<int, int>> meshDraws;
+};
+
+GpuCullScene gpuCullScene;
+
+void BuildGpuCullScene(GpuCullScene& gpuScene){
+    gpuScene.objectCount = scene.objects.size();
+    gpuScene.meshCount = scene.meshes.size();
+    gpuScene.records.clear();
+    gpuScene.recordObjects.clear();
+    gpuScene.meshDraws.clear();
+    gpuScene.buckets.clear();
+    
+    vector<int> meshRecordCounts(scene.meshes.size(), 0);
+    for(int pass = 0; pass < 2; pass++){
+        for(int i = 0; i < scene.objects.size(); i++){
+            const auto& obj = scene.objects[i];
+            if(obj.isStatic != (pass == 0)){
+                continue;
+            }
+            
+            for(auto meshIndex : obj.meshIndices){
+                if(GetInstancedShader(GetMesh(meshIndex), false, true) == nullptr){
+                    gpuScene.meshDraws.push_back(make_pair(i, meshIndex));
+                    continue;
+                }
+                
+                auto record = GpuCullRecord();
+                record.model = obj.transform.GetMatrix();
+                record.meshIndex = meshIndex;
+                gpuScene.records.push_back(record);
+                gpuScene.recordObjects.push_back(i);
+                meshRecordCounts[meshIndex]++;
+            }
+        }
+        
+        if(pass == 0){
+            gpuScene.firstDynamicRecord = (int)gpuScene.records.size();
+        }
+    }
+    
+    // Commands grouped by arena so each arena is one glMultiDrawElementsIndirect call
+    vector<int> meshOrder;
+    for(int i = 0; i < scene.meshes.size(); i++){
+        if(meshRecordCounts[i] > 0){
+            meshOrder.push_back(i);
+        }
+    }
+    stable_sort(meshOrder.begin(), meshOrder.end(), [](int a, int b){
+        return GetMesh(a).arenaIndex < GetMesh(b).arenaIndex;
+    });
+    
+    vector<GpuCullMesh> meshes(scene.meshes.size(), GpuCullMesh());
+    vector<DrawElementsIndirectCommand> commands;
+    GLuint instanceBase = 0;
+    
+    for(auto meshIndex : meshOrder){
+        auto& mesh = GetMesh(meshIndex);
+        if(gpuScene.buckets.empty() || gpuScene.buckets.back().arenaIndex != mesh.arenaIndex){
+            gpuScene.buckets.push_back(IndirectBucket{ mesh.arenaIndex, nullptr, (int)commands.size(), 0 });
+        }
+        
+        auto& gpuMesh = meshes[meshIndex];
+        gpuMesh.sphere = vec4(mesh.bounds.Center(), length(mesh.bounds.Extents()));
+        gpuMesh.positionScale = vec4(mesh.positionScale, 0.0f);
+        gpuMesh.positionOffset = vec4(mesh.positionOffset, 0.0f);
+        gpuMesh.firstCommand = (GLuint)commands.size();
+        // lodErrors holds meshLodMaxCount (4) levels
+        gpuMesh.lodCount = (GLuint)std::min(mesh.lods.size(), (size_t)meshLodMaxCount);
+        
+        // Any LOD may end up with all the records of the mesh
+        for(GLuint lod = 0; lod < gpuMesh.lodCount; lod++){
+            gpuMesh.lodErrors[lod] = mesh.lods[lod].error;
+            commands.push_back(DrawElementsIndirectCommand{ (GLuint)mesh.lods[lod].indexCount, 0, (GLuint)mesh.lods[lod].firstIndex, mesh.baseVertex, instanceBase });
+            instanceBase += meshRecordCounts[meshIndex];
+        }
+        gpuScene.buckets.back().commandCount += gpuMesh.lodCount;
+    }
+    
+    gpuScene.commandCount = (int)commands.size();
+    gpuScene.instanceCapacity = (int)instanceBase;
+    
+    if(gpuScene.recordBuffer == 0){
+        glGenBuffers(1, &gpuScene.recordBuffer);
+        glGenBuffers(1, &gpuScene.meshBuffer);
+        glGenBuffers(1, &gpuScene.commandTemplateBuffer);
     }
+    
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, gpuScene.recordBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, gpuScene.records.size() * sizeof(GpuCullRecord), gpuScene.records.data(), GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, gpuScene.meshBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, meshes.size() * sizeof(GpuCullMesh), meshes.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, gpuScene.commandTemplateBuffer);
+    glBufferData(GL_COPY_WRITE_BUFFER, commands.size() * sizeof(DrawElementsIndirectCommand), commands.data(), GL_STATIC_DRAW);
+    
+    cout << "GPU culling scene: " << gpuScene.records.size() << " records, " << gpuScene.commandCount << " commands" << endl;
+}
+
+// Culling, LOD selection and command building all happen in comp_cull.glsl. The CPU only uploads the
+// transforms of dynamic objects, resets the commands and issues one dispatch and a call per arena.
+void DrawObjectsGpuCulled(bool deferred){
+    auto& gpuScene = gpuCullScene;
+    if(gpuScene.objectCount != scene.objects.size() || gpuScene.meshCount != scene.meshes.size()){
+        BuildGpuCullScene(gpuScene);
+    }
+    
+    for(auto& meshDraw : gpuScene.meshDraws){
+        auto& mesh = GetMesh(meshDraw.second);
+        const auto& shader = deferred ? GetGBufferShader(*mesh.deferredShader) : *mesh.forwardShader;
+        DrawMesh(scene.objects[meshDraw.first].transform.GetMatrix(), mesh, shader, -1);
+    }
+    
+    auto recordCount = (int)gpuScene.records.size();
+    if(recordCount == 0){
+        return;
+    }
+    
+    auto dynamicCount = recordCount - gpuScene.firstDynamicRecord;
+    if(dynamicCount > 0){
+        for(int i = gpuScene.firstDynamicRecord; i < recordCount; i++){
+            gpuScene.records[i].model = scene.objects[gpuScene.recordObjects[i]].transform.GetMatrix();
+        }
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, gpuScene.recordBuffer);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, gpuScene.firstDynamicRecord * sizeof(GpuCullRecord), dynamicCount * sizeof(GpuCullRecord), &gpuScene.records[gpuScene.firstDynamicRecord]);
+    }
+    
+    // The buffers are shared with DrawObjectsIndirect, which sizes them to its own frame
+    auto instanceBytes = (GLsizeiptr)gpuScene.instanceCapacity * sizeof(IndirectInstance);
+    if(indirectInstanceBufferSize < instanceBytes){
+        glBindBuffer(GL_ARRAY_BUFFER, indirectInstanceBuffer);
+        glBufferData(GL_ARRAY_BUFFER, instanceBytes, NULL, GL_DYNAMIC_COPY);
+        indirectInstanceBufferSize = instanceBytes;
+    }
+    auto commandBytes = (GLsizeiptr)gpuScene.commandCount * sizeof(DrawElementsIndirectCommand);
+    if(indirectCommandBufferSize < commandBytes){
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirectCommandBuffer);
+        glBufferData(GL_DRAW_INDIRECT_BUFFER, commandBytes, NULL, GL_DYNAMIC_COPY);
+        indirectCommandBufferSize = commandBytes;
+    }
+    
+    glBindBuffer(GL_COPY_READ_BUFFER, gpuScene.commandTemplateBuffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, indirectCommandBuffer);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, commandBytes);
+    
+    auto frustum = camera.GetFrustum();
+    auto& uniforms = cullComputeShader.uniforms;
+    glUseProgram(cullComputeShader.programId);
+    uniforms.recordCount.Set(recordCount);
+    uniforms.cullingEnabled.Set(cullingEnabled);
+    uniforms.frustumPlanes.Set(frustum.planes, 6);
+    uniforms.lodErrorScale.Set(lodEnabled ? GetPixelsPerUnit() / lodMaxPixelError : 0.0f);
+    uniforms.cameraNear.Set(camera.near);
+    
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, gpuScene.recordBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, gpuScene.meshBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, indirectCommandBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, indirectInstanceBuffer);
+    glDispatchCompute((recordCount + 63) / 64, 1, 1);
+    
+    // The draws read the commands and the instance attributes the dispatch wrote
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+    
+    ApplyPolygonMode();
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirectCommandBuffer);
+    
+    const auto& shader = deferred ? GetGBufferShader(deferredIndirectShader) : forwardIndirectShader;
+    glUseProgram(shader.programId);
+    for(auto& bucket : gpuScene.buckets){
+        glBindVertexArray(geometryArenas[bucket.arenaIndex].indirectVao);
+        glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, BUFFER_OFFSET(bucket.firstCommand * sizeof(DrawElementsIndirectCommand)), bucket.commandCount, 0);
+    }
+    
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
+
+bool IsGpuCullingActive(){
+    return gpuCulling && gpuCullingSupported;
+}
+
+// CPU time of the DrawSceneObjects calls this frame, for the frame log
+float submitMilliseconds = 0.0f;
+
+// Geometry of the visible objects, with the submission mode selected by gpuCulling, renderIndirect and renderInstanced
+void DrawSceneObjects(bool deferred){
+    auto submitBegin = glfwGetTime();
+    
+    if(IsGpuCullingActive()){
+        DrawObjectsGpuCulled(deferred);
+    }
+    else if(renderIndirect && multiDrawIndirectSupported){
+        DrawObjectsIndirect(deferred);
+    }
+    else if(renderInstanced){
+        DrawObjectsInstanced(deferred);
+    }
+    else{
+        for(int i = 0; i < visibleObjects.size(); i++){
+            const auto& obj = scene.objects[visibleObjects[i]];
+            DrawObject(obj, deferred, -1);
+        }
+    }
+    
+    submitMilliseconds += (float)((glfwGetTime() - submitBegin) * 1000.0);
 }
 
 vec3 ClampLength(vec3 vector, float clampLength){
@@ -1254,8 +2717,37 @@ void UpdateTime() {
 }
 
 void UpdateLightData(){
-    UpdateLightDataForShader(deferredLightShader);
-    UpdateLightDataForShader(forwardGeometryShader);
+    auto& lights = lightBuffers;
+    auto lightCount = scene.lightCount;
+    
+    lights.positions.resize(lightCount);
+    lights.intensities.resize(lightCount);
+    
+    for(int i = 0; i < lightCount; i++){
+        lights.positions[i] = vec4(scene.lightPos[i], scene.lightRadius[i]);
+        lights.intensities[i] = vec4(scene.lightIntensity[i], 0.0f);
+    }
+    
+    auto arraySize = lightCount * sizeof(vec4);
+    
+    if(lightCount > lights.capacity){
+        while(lights.capacity < lightCount){
+            lights.capacity *= 2;
+        }
+        
+        // The texture refers to the buffer object, so reallocating the storage doesn't need glTexBuffer again
+        glBindBuffer(GL_TEXTURE_BUFFER, lights.positionBuffer);
+        glBufferData(GL_TEXTURE_BUFFER, lights.capacity * sizeof(vec4), NULL, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_TEXTURE_BUFFER, lights.intensityBuffer);
+        glBufferData(GL_TEXTURE_BUFFER, lights.capacity * sizeof(vec4), NULL, GL_DYNAMIC_DRAW);
+    }
+    
+    // Only upload the part that is in use, the count itself goes through FrameData
+    glBindBuffer(GL_TEXTURE_BUFFER, lights.positionBuffer);
+    glBufferSubData(GL_TEXTURE_BUFFER, 0, arraySize, lights.positions.data());
+    glBindBuffer(GL_TEXTURE_BUFFER, lights.intensityBuffer);
+    glBufferSubData(GL_TEXTURE_BUFFER, 0, arraySize, lights.intensities.data());
+    CheckError();
 }
 
 void UpdateLights(){
@@ -1278,7 +2770,8 @@ void UpdateLights(){
             auto& pos = scene.lightPos[i];
             pos += velocity * dt;
             
-            scene.lightObjects[scene.lightObjIndex[i]].transform.position = pos;
+            if(scene.lightObjIndex[i] != -1)
+                scene.lightObjects[scene.lightObjIndex[i]].transform.position = pos;
         }
         else{
             auto& velocity = scene.ligthVelocity[i];
@@ -1291,11 +2784,10 @@ void UpdateLights(){
                 scene.lightHitGround[i] = true;
             }
             
-            scene.lightObjects[scene.lightObjIndex[i]].transform.position = pos;
+            if(scene.lightObjIndex[i] != -1)
+                scene.lightObjects[scene.lightObjIndex[i]].transform.position = pos;
         }
     }
-    
-    UpdateLightData();
 }
 
 void RunSimulation(){
@@ -1307,20 +2799,18 @@ void RunSimulation(){
     firstFrame = false;
 }
 
-void DrawGround(const mat4& projectionMatrix, const mat4& viewingMatrix){
+void DrawGround(){
     
     auto modelingMatrix = groundTransform.GetMatrix();
     // auto programId = renderDeferred ? deferredGroundShader.programId : forwardGroundShader.programId;
-    auto programId = forwardGroundShader.programId;
+    auto& uniforms = forwardGroundShader.uniforms;
     
-    glUseProgram(programId);
+    glUseProgram(forwardGroundShader.programId);
     // bind textures on corresponding texture units
     // glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, ourTexture);
     
-    glUniformMatrix4fv(glGetUniformLocation(programId, "projection"), 1, GL_FALSE, glm::value_ptr(projectionMatrix));
-    glUniformMatrix4fv(glGetUniformLocation(programId, "view"), 1, GL_FALSE, glm::value_ptr(viewingMatrix));
-    glUniformMatrix4fv(glGetUniformLocation(programId, "model"), 1, GL_FALSE, glm::value_ptr(modelingMatrix));
+    uniforms.model.Set(modelingMatrix);
 
     glBindVertexArray(groundVao);
     glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
@@ -1335,26 +2825,23 @@ void ClearScreen(){
 
 
 void DrawSceneForward(){
-    auto projectionMatrix = camera.GetProjectionMatrix();
-    auto viewingMatrix = camera.GetViewingMatrix();
-    
-    for(int i = 0; i < scene.objects.size(); i++){
-        const auto& obj = scene.objects[i];
-        
-        // TODO: Remove later
-        if(obj.name == "Player")
-            continue;
-        
-        DrawObject(projectionMatrix, viewingMatrix, obj, renderDeferred, -1);
+    if(forwardLightingMode == ForwardLightingClustered){
+        glActiveTexture(GL_TEXTURE5);
+        glBindTexture(GL_TEXTURE_BUFFER, clusterLightGrid.cellTexture);
+        glActiveTexture(GL_TEXTURE6);
+        glBindTexture(GL_TEXTURE_BUFFER, clusterLightGrid.indexTexture);
+        glActiveTexture(GL_TEXTURE0);
     }
     
+    DrawSceneObjects(renderDeferred);
+    
     for(int i = 0; i < scene.lightObjects.size(); i++){
         const auto& obj = scene.lightObjects[i];
-        DrawObject(projectionMatrix, viewingMatrix, obj, renderDeferred, i);
+        DrawObject(obj, renderDeferred, i);
     }
     
     // Drawing ground doesn't work.
-    // DrawGround(projectionMatrix, viewingMatrix);
+    // DrawGround();
 }
 
 unsigned int quadVAO = 0;
@@ -1387,71 +2874,30 @@ void RenderQuad()
     glBindVertexArray(0);
 }
 
-void DrawSceneDeferred(){
-    
-    // 1. geometry pass: render scene's geometry/color data into gbuffer
-    // -----------------------------------------------------------------
-    glBindFramebuffer(GL_FRAMEBUFFER, gBuffer);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    
-    auto objectCount = scene.objects.size();
-    auto projectionMatrix = camera.GetProjectionMatrix();
-    auto viewingMatrix = camera.GetViewingMatrix();
-    
-    for(int i = 0; i < objectCount; i++){
-        const auto& obj = scene.objects[i];
-        
-        // TODO: Remove later
-        if(obj.name == "Player")
-            continue;
-        
-        DrawObject(projectionMatrix, viewingMatrix, obj, renderDeferred, -1);
-    }
-        
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-
-    // 2. lighting pass: calculate lighting by iterating over a screen filled quad pixel-by-pixel using the gbuffer's content.
-    // -----------------------------------------------------------------------------------------------------------------------
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    
-    glUseProgram(deferredLightShader.programId);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gPosition);
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, gNormal);
-    glActiveTexture(GL_TEXTURE2);
-    glBindTexture(GL_TEXTURE_2D, gAlbedoSpec);
-    
-    // send light relevant uniforms
-    glUniform3fv(glGetUniformLocation(deferredLightShader.programId, "cameraPos"), 1, glm::value_ptr(camera.position));
-    CheckError();
-
-    // finally render quad
-    RenderQuad();
-
-    // 2.5. copy content of geometry's depth buffer to default framebuffer's depth buffer
-    // ----------------------------------------------------------------------------------
+void BlitGBufferDepth(){
     glBindFramebuffer(GL_READ_FRAMEBUFFER, gBuffer);
     glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0); // write to default framebuffer
     
-    // TODO: Don't know why do I need to multiply by 2 (?)
-    auto width = camera.screen.width * 2;
-    auto height = camera.screen.height * 2;
+    // Same size as the default framebuffer, reallocated in OnFramebufferResized
+    auto width = gBufferWidth;
+    auto height = gBufferHeight;
     
     // blit to default framebuffer. Note that this may or may not work as the internal formats of both the FBO and default framebuffer have to match.
     // the internal formats are implementation defined. This works on all of my systems, but if it doesn't on yours you'll likely have to write to the
     // depth buffer in another shader stage (or somehow see to match the default framebuffer's internal format with the FBO's internal format).
     glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    
+}
+
+void DrawLightObjects(){
     for(int i = 0; i < scene.lightObjects.size(); i++){
         const auto& obj = scene.lightObjects[i];
         
-        DrawObject(projectionMatrix, viewingMatrix, obj, renderDeferred, i);
+        DrawObject(obj, renderDeferred, i);
     }
   
     // This doesn't work.
-    // DrawGround(projectionMatrix, viewingMatrix);
+    // DrawGround();
 
     // 3. render lights on top of scene
     // --------------------------------
@@ -1472,9 +2918,402 @@ void DrawSceneDeferred(){
      */
 }
 
+void BindGBufferTextures(){
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, compactGBuffer ? gDepth : gPosition);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, gNormal);
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_2D, gAlbedoSpec);
+}
+
+// Scales the light volume mesh to unit radius, inflated a bit since the flat faces of the tessellated
+// sphere lie inside the real sphere.
+float GetLightVolumeScale(const Mesh& mesh){
+    auto extents = mesh.bounds.Extents();
+    auto meshRadius = glm::max(extents.x, glm::max(extents.y, extents.z));
+    return 1.1f / meshRadius;
+}
+
+// One instanced sphere per light, scaled by the light radius in the vertex shader. Only the pixels covered
+// by a volume are shaded, the contributions of overlapping lights are added with blending.
+void DrawLightVolumes(){
+    if(scene.lightCount == 0){
+        return;
+    }
+    
+    auto& mesh = GetMesh(lightVolumeMesh);
+    auto& shader = GetGBufferShader(deferredLightVolumeShader);
+    auto& uniforms = shader.uniforms;
+    glUseProgram(shader.programId);
+    uniforms.volumeScale.Set(GetLightVolumeScale(mesh));
+    uniforms.lightOffset.Set(0);
+    SetMeshUniforms(uniforms, mesh);
+    BindGBufferTextures();
+    
+    // Back faces with GL_GEQUAL: a pixel is shaded when the surface is in front of the far side of the volume,
+    // this also works when the camera is inside the volume. Depth is read only so volumes don't occlude each other.
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE);
+    glEnable(GL_CULL_FACE);
+    glCullFace(GL_FRONT);
+    glDepthFunc(GL_GEQUAL);
+    glDepthMask(GL_FALSE);
+    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+    
+    glBindVertexArray(GetMeshArena(mesh).vao);
+    DrawMeshElements(mesh, mesh.lods[0], scene.lightCount);
+    
+    glDepthMask(GL_TRUE);
+    glDepthFunc(GL_LESS);
+    glCullFace(GL_BACK);
+    glDisable(GL_CULL_FACE);
+    glDisable(GL_BLEND);
+    ApplyPolygonMode();
+}
+
+// Two passes per light. The stencil pass counts, per pixel, the back faces behind the surface minus the
+// front faces behind it, which is non zero only when the surface is inside the sphere. The light pass then
+// shades just those pixels and resets their stencil for the next light, so large lights close to the camera
+// no longer shade everything their volume covers on screen.
+void DrawLightVolumesStenciled(){
+    if(scene.lightCount == 0){
+        return;
+    }
+    
+    auto& mesh = GetMesh(lightVolumeMesh);
+    auto volumeScale = GetLightVolumeScale(mesh);
+    
+    auto& stencilUniforms = deferredLightVolumeStencilShader.uniforms;
+    glUseProgram(deferredLightVolumeStencilShader.programId);
+    stencilUniforms.volumeScale.Set(volumeScale);
+    SetMeshUniforms(stencilUniforms, mesh);
+    
+    auto& lightShader = GetGBufferShader(deferredLightVolumeShader);
+    auto& lightUniforms = lightShader.uniforms;
+    glUseProgram(lightShader.programId);
+    lightUniforms.volumeScale.Set(volumeScale);
+    SetMeshUniforms(lightUniforms, mesh);
+    BindGBufferTextures();
+    
+    auto projectionMatrix = camera.GetProjectionMatrix();
+    auto viewingMatrix = camera.GetViewingMatrix();
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    
+    glEnable(GL_STENCIL_TEST);
+    glDepthMask(GL_FALSE);
+    glBlendFunc(GL_ONE, GL_ONE);
+    glCullFace(GL_FRONT);
+    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+    glBindVertexArray(GetMeshArena(mesh).vao);
+    
+    for(int i = 0; i < scene.lightCount; i++){
+        ScreenRect rect;
+        if(!GetSphereScreenRect(scene.lightPos[i], scene.lightRadius[i], viewingMatrix, projectionMatrix, viewport[2], viewport[3], rect)){
+            continue;
+        }
+        
+        // Stencil pass: both faces, depth tested, no color
+        glUseProgram(deferredLightVolumeStencilShader.programId);
+        stencilUniforms.lightOffset.Set(i);
+        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+        glEnable(GL_DEPTH_TEST);
+        glDisable(GL_CULL_FACE);
+        glDisable(GL_BLEND);
+        glStencilFunc(GL_ALWAYS, 0, 0xFF);
+        glStencilOpSeparate(GL_BACK, GL_KEEP, GL_INCR_WRAP, GL_KEEP);
+        glStencilOpSeparate(GL_FRONT, GL_KEEP, GL_DECR_WRAP, GL_KEEP);
+        DrawMeshElements(mesh, mesh.lods[0], 1);
+        
+        // Light pass: back faces so it still works with the camera inside the volume, marked pixels only
+        glUseProgram(lightShader.programId);
+        lightUniforms.lightOffset.Set(i);
+        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+        glDisable(GL_DEPTH_TEST);
+        glEnable(GL_CULL_FACE);
+        glEnable(GL_BLEND);
+        glStencilFunc(GL_NOTEQUAL, 0, 0xFF);
+        glStencilOp(GL_KEEP, GL_KEEP, GL_ZERO);
+        DrawMeshElements(mesh, mesh.lods[0], 1);
+    }
+    
+    glStencilOp(GL_KEEP, GL_KEEP, GL_KEEP);
+    glStencilFunc(GL_ALWAYS, 0, 0xFF);
+    glDisable(GL_STENCIL_TEST);
+    glEnable(GL_DEPTH_TEST);
+    glDepthMask(GL_TRUE);
+    glCullFace(GL_BACK);
+    glDisable(GL_CULL_FACE);
+    glDisable(GL_BLEND);
+    ApplyPolygonMode();
+}
+
+// Hi-Z pyramid of the gbuffer depth. The first levels are reduced on the GPU, the smallest one is read back
+// and HiZBuffer continues down to 1x1 on the CPU where the occlusion tests run.
+struct HiZPyramid {
+    GLuint texture = 0;
+    GLuint framebuffer = 0;
+    // Level 0 is half the gbuffer, the last GPU level is the one read back
+    int width = 0;
+    int height = 0;
+    int levelCount = 0;
+    vector<float> readback;
+    HiZBuffer buffer;
+};
+
+HiZPyramid hiZ;
+// Widest level that is read back, small enough that the readback costs little
+const int hiZReadbackMaxWidth = 128;
+
+// Frustum visible objects of this frame, and the ones drawn in the first phase
+vector<int> frustumVisibleObjects;
+vector<int> firstPhaseObjects;
+// Frustum visible objects the Hi-Z test rejected this frame, for the frame log
+int occludedObjectCount = 0;
+
+bool IsOcclusionCullingActive(){
+    return occlusionCulling && renderDeferred && !IsGpuCullingActive();
+}
+
+int GetHiZLevelSize(int size, int level){
+    return std::max(1, size >> level);
+}
+
+void ResizeHiZ(int width, int height){
+    width = std::max(1, width / 2);
+    height = std::max(1, height / 2);
+    if(hiZ.texture != 0 && hiZ.width == width && hiZ.height == height){
+        return;
+    }
+    
+    hiZ.width = width;
+    hiZ.height = height;
+    hiZ.levelCount = 1;
+    while(GetHiZLevelSize(width, hiZ.levelCount - 1) > hiZReadbackMaxWidth){
+        hiZ.levelCount++;
+    }
+    
+    if(hiZ.texture == 0){
+        glGenTextures(1, &hiZ.texture);
+        glGenFramebuffers(1, &hiZ.framebuffer);
+    }
+    glBindTexture(GL_TEXTURE_2D, hiZ.texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    for(int level = 0; level < hiZ.levelCount; level++){
+        glTexImage2D(GL_TEXTURE_2D, level, GL_R32F, GetHiZLevelSize(width, level), GetHiZLevelSize(height, level), 0, GL_RED, GL_FLOAT, NULL);
+    }
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, hiZ.levelCount - 1);
+    
+    auto last = hiZ.levelCount - 1;
+    hiZ.readback.resize(GetHiZLevelSize(width, last) * GetHiZLevelSize(height, last));
+    cout << "Hi-Z: " << width << "x" << height << ", " << hiZ.levelCount << " GPU levels" << endl;
+}
+
+// Reduces the gbuffer depth level by level, each level samples the one before it with the base and max level
+// limited to it, so a level is never read and written at once. The readback waits for the GPU to finish the
+// geometry drawn so far, the pyramid is small enough that this is the only cost.
+void BuildHiZ(){
+    ResizeHiZ(gBufferWidth, gBufferHeight);
+    
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    
+    glBindFramebuffer(GL_FRAMEBUFFER, hiZ.framebuffer);
+    glUseProgram(hiZReduceShader.programId);
+    glDisable(GL_DEPTH_TEST);
+    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+    glActiveTexture(GL_TEXTURE0);
+    
+    for(int level = 0; level < hiZ.levelCount; level++){
+        if(level == 0){
+            glBindTexture(GL_TEXTURE_2D, gDepth);
+        }
+        else{
+            glBindTexture(GL_TEXTURE_2D, hiZ.texture);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level - 1);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, level - 1);
+        }
+        
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, hiZ.texture, level);
+        glViewport(0, 0, GetHiZLevelSize(hiZ.width, level), GetHiZLevelSize(hiZ.height, level));
+        RenderQuad();
+    }
+    
+    glBindTexture(GL_TEXTURE_2D, hiZ.texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, hiZ.levelCount - 1);
+    
+    // The last level is still attached
+    auto last = hiZ.levelCount - 1;
+    auto width = GetHiZLevelSize(hiZ.width, last);
+    auto height = GetHiZLevelSize(hiZ.height, last);
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    glReadPixels(0, 0, width, height, GL_RED, GL_FLOAT, hiZ.readback.data());
+    hiZ.buffer.Build(hiZ.readback.data(), width, height);
+    
+    glBindFramebuffer(GL_FRAMEBUFFER, gBuffer);
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+    glEnable(GL_DEPTH_TEST);
+    ApplyPolygonMode();
+    CheckError();
+}
+
+// Screen rectangle and nearest depth of the object's world bounds against the Hi-Z buffer. Bounds that reach
+// the near plane are never occluded.
+bool IsObjectOccluded(const Object& obj, const mat4& viewProjection){
+    const auto& bounds = obj.worldBounds;
+    auto rectMin = vec3(1.0f);
+    auto rectMax = vec3(-1.0f);
+    
+    for(int i = 0; i < 8; i++){
+        auto corner = vec3(i & 1 ? bounds.max.x : bounds.min.x, i & 2 ? bounds.max.y : bounds.min.y, i & 4 ? bounds.max.z : bounds.min.z);
+        auto clip = viewProjection * vec4(corner, 1.0f);
+        if(clip.w <= camera.near){
+            return false;
+        }
+        
+        auto ndc = vec3(clip) / clip.w;
+        rectMin = i == 0 ? ndc : glm::min(rectMin, ndc);
+        rectMax = i == 0 ? ndc : glm::max(rectMax, ndc);
+    }
+    
+    // NDC to [0, 1], rows are bottom up in both
+    return hiZ.buffer.IsOccluded(rectMin.x * 0.5f + 0.5f, rectMin.y * 0.5f + 0.5f, rectMax.x * 0.5f + 0.5f, rectMax.y * 0.5f + 0.5f, rectMin.z * 0.5f + 0.5f);
+}
+
+// Two phase occlusion culling of the frustum visible objects:
+// 1. the objects that were visible last frame are drawn, their depth stands in for this frame's occluders
+// 2. a Hi-Z pyramid of that depth tests every object, the ones that became visible are drawn as well.
+// Objects are only rejected by depth of this frame, so nothing pops in a frame late when the view changes.
+void DrawSceneObjectsOccluded(bool deferred){
+    objectVisibleLastFrame.resize(scene.objects.size(), 1);
+    frustumVisibleObjects.swap(visibleObjects);
+    
+    firstPhaseObjects.clear();
+    for(auto i : frustumVisibleObjects){
+        if(objectVisibleLastFrame[i]){
+            firstPhaseObjects.push_back(i);
+        }
+    }
+    visibleObjects = firstPhaseObjects;
+    DrawSceneObjects(deferred);
+    
+    BuildHiZ();
+    
+    auto viewProjection = camera.GetProjectionMatrix() * camera.GetViewingMatrix();
+    visibleObjects.clear();
+    occludedObjectCount = 0;
+    for(auto i : frustumVisibleObjects){
+        auto visible = !IsObjectOccluded(scene.objects[i], viewProjection);
+        if(visible && !objectVisibleLastFrame[i]){
+            visibleObjects.push_back(i);
+        }
+        occludedObjectCount += !visible;
+        objectVisibleLastFrame[i] = visible;
+    }
+    DrawSceneObjects(deferred);
+    
+    // Everything drawn this frame, for the frame log
+    visibleObjects.insert(visibleObjects.end(), firstPhaseObjects.begin(), firstPhaseObjects.end());
+}
+
+void DrawSceneDeferred(){
+    
+    // 1. geometry pass: render scene's geometry/color data into gbuffer
+    // -----------------------------------------------------------------
+    glBindFramebuffer(GL_FRAMEBUFFER, gBuffer);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    
+    if(IsOcclusionCullingActive()){
+        DrawSceneObjectsOccluded(renderDeferred);
+    }
+    else{
+        DrawSceneObjects(renderDeferred);
+    }
+        
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    // 2. lighting pass: calculate lighting by iterating over a screen filled quad pixel-by-pixel using the gbuffer's content.
+    // -----------------------------------------------------------------------------------------------------------------------
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    
+    if(deferredLightingMode == DeferredLightingVolumes || deferredLightingMode == DeferredLightingStencilVolumes){
+        // The volumes are depth tested against the scene, so the depth is copied before lighting
+        BlitGBufferDepth();
+        
+        if(deferredLightingMode == DeferredLightingVolumes){
+            DrawLightVolumes();
+        }
+        else{
+            glClear(GL_STENCIL_BUFFER_BIT);
+            DrawLightVolumesStenciled();
+        }
+        
+        DrawLightObjects();
+        return;
+    }
+    
+    if(deferredLightingMode == DeferredLightingTiled){
+        // Actual framebuffer size, this is not camera.screen on HiDPI displays
+        GLint viewport[4];
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        BuildLightGrid(tileLightGrid, viewport[2], viewport[3]);
+        
+        auto& shader = GetGBufferShader(deferredTiledLightShader);
+        auto& uniforms = shader.uniforms;
+        glUseProgram(shader.programId);
+        uniforms.tileSize.Set(tileLightGrid.tileSize);
+        uniforms.tilesX.Set(tileLightGrid.tilesX);
+        
+        glActiveTexture(GL_TEXTURE3);
+        glBindTexture(GL_TEXTURE_BUFFER, tileLightGrid.cellTexture);
+        glActiveTexture(GL_TEXTURE4);
+        glBindTexture(GL_TEXTURE_BUFFER, tileLightGrid.indexTexture);
+    }
+    else{
+        glUseProgram(GetGBufferShader(deferredLightShader).programId);
+    }
+    
+    BindGBufferTextures();
+    
+    // light data is in the light buffers, cameraPos in the FrameData block
+
+    // finally render quad
+    RenderQuad();
+
+    // 2.5. copy content of geometry's depth buffer to default framebuffer's depth buffer
+    // ----------------------------------------------------------------------------------
+    BlitGBufferDepth();
+    DrawLightObjects();
+}
+
+
 void Render(GLFWwindow* window){
     ClearScreen();
     
+    // Uploaded every frame (not in UpdateLights), radii also change while the simulation is paused
+    UpdateLightData();
+    
+    // The cluster grid size goes into FrameData, so it is built first
+    if(renderDeferred == 0 && forwardLightingMode == ForwardLightingClustered){
+        GLint viewport[4];
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        BuildLightGrid(clusterLightGrid, viewport[2], viewport[3]);
+    }
+    
+    UpdateFrameData(camera.GetProjectionMatrix(), camera.GetViewingMatrix());
+    
+    // GPU culling does its own culling in the compute pass
+    if(IsGpuCullingActive()){
+        visibleObjects.clear();
+    }
+    else{
+        CullScene();
+    }
+    
     if(renderDeferred == 0){
         DrawSceneForward();
     } else{
@@ -1501,8 +3340,74 @@ void UpdateInput(GLFWwindow* window){
     }
 }
 
+// Command line options, see ParseRunOptions
+struct RunOptions {
+    // Exits after this many frames when non zero, with a hidden window
+    int frameCount = 0;
+    bool deferred = false;
+    bool instanced = false;
+    bool indirect = false;
+    bool gpuCulling = false;
+    bool occlusion = false;
+};
+
+RunOptions runOptions;
+
+// Usage: ./main [--frames N] [--deferred] [--instanced] [--indirect] [--gpu-culling] [--occlusion]
+void ParseRunOptions(int argc, char** argv){
+    for(int i = 1; i < argc; i++){
+        string argument = argv[i];
+        if(argument == "--frames" && i + 1 < argc){
+            runOptions.frameCount = atoi(argv[++i]);
+        }
+        else if(argument == "--deferred"){
+            runOptions.deferred = true;
+        }
+        else if(argument == "--instanced"){
+            runOptions.instanced = true;
+        }
+        else if(argument == "--indirect"){
+            runOptions.indirect = true;
+        }
+        else if(argument == "--gpu-culling"){
+            runOptions.gpuCulling = true;
+        }
+        else if(argument == "--occlusion"){
+            runOptions.occlusion = true;
+        }
+        else{
+            cout << "Unknown option " << argument << endl;
+        }
+    }
+}
+
+// Same as pressing F, I, M, U and H
+void ApplyRunOptions(){
+    occlusionCulling = runOptions.occlusion;
+
+    gpuCulling = runOptions.gpuCulling && gpuCullingSupported;
+    if(runOptions.gpuCulling && !gpuCullingSupported){
+        cout << "GPU culling is not supported, culling on the CPU" << endl;
+    }
+    
+    renderInstanced = runOptions.instanced;
+    renderIndirect = runOptions.indirect && multiDrawIndirectSupported;
+    if(runOptions.indirect && !multiDrawIndirectSupported){
+        cout << "Multi-draw indirect is not supported, falling back to " << (renderInstanced ? "instanced" : "per object") << " draws" << endl;
+    }
+    
+    if(runOptions.deferred){
+        renderDeferred = 1;
+        InitDeferredRendering();
+    }
+}
+
 void ProgramLoop(GLFWwindow* window){
-    while (!glfwWindowShouldClose(window))
+    int frameIndex = 0;
+    double totalRenderMs = 0.0;
+    double totalSubmitMs = 0.0;
+    
+    while (!glfwWindowShouldClose(window) && (runOptions.frameCount == 0 || frameIndex < runOptions.frameCount))
     {
         UpdateInput(window);
         
@@ -1510,20 +3415,39 @@ void ProgramLoop(GLFWwindow* window){
             RunSimulation();
         }
         
+        drawnTriangleCount = 0;
+        submitMilliseconds = 0.0f;
         auto renderBegin = GetCurrentTime();
         Render(window);
         auto renderEnd = GetCurrentTime();
         auto renderDt = renderEnd - renderBegin;
         auto renderMs = renderDt * 1000;
-        auto modeText = renderDeferred ? "Deferred" : "Forward";
+        auto modeText = renderDeferred ? string("Deferred (") + GetDeferredLightingModeName(deferredLightingMode) + ")" : string("Forward (") + GetForwardLightingModeName(forwardLightingMode) + ")";
+        auto instancedText = renderInstanced ? "On" : "Off";
+        auto indirectText = renderIndirect ? "On" : "Off";
         auto lightCount = to_string(scene.lightCount);
-        cout << "Render Milliseconds: " << to_string(renderMs) << " Mode: " << modeText << " LightCount: " << lightCount << endl;
+        // Visibility of GPU culling never comes back to the CPU
+        auto visibleCount = IsGpuCullingActive() ? string("GPU") : to_string(visibleObjects.size());
+        if(IsOcclusionCullingActive()){
+            visibleCount += " (" + to_string(occludedObjectCount) + " occluded)";
+        }
+        cout << "Render Milliseconds: " << to_string(renderMs) << " Submit Milliseconds: " << to_string(submitMilliseconds) << " Mode: " << modeText << " Instanced: " << instancedText << " Indirect: " << indirectText << " Visible: " << visibleCount << " Triangles: " << drawnTriangleCount << " LOD: " << (lodEnabled ? "On" : "Off") << " LightCount: " << lightCount << endl;
+        
+        frameIndex++;
+        totalRenderMs += renderMs;
+        totalSubmitMs += submitMilliseconds;
+    }
+    
+    if(runOptions.frameCount > 0 && frameIndex > 0){
+        cout << frameIndex << " frames, average Render Milliseconds: " << totalRenderMs / frameIndex << " Submit Milliseconds: " << totalSubmitMs / frameIndex << endl;
     }
 }
 
 
-int main()
+int main(int argc, char** argv)
 {
+    ParseRunOptions(argc, argv);
+    
     if (!glfwInit())
     {
         cout << "GLFWInit Failed." << endl;
@@ -1531,6 +3455,10 @@ int main()
     }
     
     AddWindowHints();
+    // Benchmark runs (--frames) don't need to show anything, which also lets them run on a virtual display
+    if(runOptions.frameCount > 0){
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    }
     
     auto window = CreateWindow();
     if (!window)
@@ -1546,7 +3474,14 @@ int main()
     InitGlew();
     SetWindowTitle(window);
     
+    // The resize callback only fires on changes, the initial size has to be queried
+    glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+    glViewport(0, 0, framebufferWidth, framebufferHeight);
+    cout << "Culling kernel: " << GetCullKernelName(cullKernel) << endl;
+    cout << "Multi-draw indirect: " << (multiDrawIndirectSupported ? "supported" : "not supported") << ", GPU culling: " << (gpuCullingSupported ? "supported" : "not supported") << endl;
+    
     InitProgram(window);
+    ApplyRunOptions();
     
     RegisterKeyPressEvents(window);
     RegisterWindowResizeEvents(window);
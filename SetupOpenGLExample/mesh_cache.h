@@ -0,0 +1,336 @@
+#pragma once
+
+// Binary mesh cache, written next to the OBJ by the asset cooker (cook_assets.cpp), or by the game after the
+// first parse when the mesh wasn't cooked (armadillo.obj -> armadillo.obj.meshcache).
+// Has no GL/GLM dependency, the attribute types are stored as their GL enum values.
+//
+// Layout: MeshCacheHeader, then the vertex blob and the index blob at 16 byte aligned offsets. The blobs
+// are exactly what InitVBO uploads, so the mapped file is handed to glBufferData without any copy.
+// The index blob holds every LOD back to back, the header lists their ranges.
+// The header records the size, modification time and path hash of the source, a cache whose key doesn't
+// match the OBJ anymore (or whose version is older) is ignored and rewritten.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <climits>
+#include <cstdlib>
+
+#include <sys/stat.h>
+
+#include "obj_parser.h"
+#include "mesh_optimizer.h"
+#include "mesh_simplifier.h"
+
+const uint32_t meshCacheMagic = 0x434D5244; // "DRMC"
+// 2: vertices in fetch order, 3: quantized interleaved layout, 4: vertex cache/overdraw order and its stats,
+// 5: LOD chain, 6: interleaved float layout
+const uint32_t meshCacheVersion = 6;
+const int meshCacheMaxAttributes = 4;
+
+// GL enum values
+const uint32_t meshCacheFloat = 0x1406;                // GL_FLOAT
+const uint32_t meshCacheUnsignedInt = 0x1405;          // GL_UNSIGNED_INT
+const uint32_t meshCacheUnsignedShort = 0x1403;        // GL_UNSIGNED_SHORT
+const uint32_t meshCacheInt2101010Rev = 0x8D9F;        // GL_INT_2_10_10_10_REV
+
+// Source file identity, the cache is valid while all three match
+struct MeshCacheKey {
+    uint64_t size = 0;
+    int64_t modifiedTime = 0;  // Nanoseconds
+    uint64_t pathHash = 0;
+};
+
+// Range of the index blob, LOD 0 is the full mesh. error is in object space, see MeshLodLevel.
+struct MeshCacheLod {
+    uint32_t firstIndex;
+    uint32_t indexCount;
+    float error;
+    uint32_t padding;
+};
+
+// One glVertexAttribPointer call, offset is relative to the start of the vertex blob
+struct MeshCacheAttribute {
+    uint32_t location;
+    uint32_t components;
+    uint32_t type;
+    uint32_t normalized;
+    uint32_t stride;
+    uint32_t offset;
+};
+
+struct MeshCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    MeshCacheKey key;
+    float boundsMin[3];
+    float boundsMax[3];
+    // The vertex shaders decode positions as attribute * positionScale + positionOffset
+    float positionScale[3];
+    float positionOffset[3];
+    // Post-transform cache efficiency of the stored index order, see AnalyzeVertexCache
+    float acmr;
+    float atvr;
+    uint32_t vertexCount;
+    uint32_t indexCount;
+    uint32_t indexType;
+    uint32_t attributeCount;
+    MeshCacheAttribute attributes[meshCacheMaxAttributes];
+    uint32_t lodCount;
+    uint32_t padding;
+    MeshCacheLod lods[meshLodMaxCount];
+    uint64_t vertexOffset;
+    uint64_t vertexBytes;
+    uint64_t indexOffset;
+    uint64_t indexBytes;
+};
+
+// Points into a cache image, either a mapped file or the one just built
+struct MeshCacheView {
+    const MeshCacheHeader* header = nullptr;
+    const void* vertexData = nullptr;
+    const void* indexData = nullptr;
+};
+
+inline std::string GetMeshCachePath(const std::string& sourcePath){
+    return sourcePath + ".meshcache";
+}
+
+// FNV-1a of the canonical path, so the cooker and the game agree however they spell the directory
+inline uint64_t HashMeshCachePath(const std::string& path){
+    char canonical[PATH_MAX];
+    std::string resolved = realpath(path.c_str(), canonical) ? canonical : path;
+
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for(auto c : resolved){
+        hash = (hash ^ (uint8_t)c) * 0x100000001B3ull;
+    }
+    return hash;
+}
+
+inline bool GetMeshCacheKey(const std::string& sourcePath, MeshCacheKey& key){
+    struct stat info;
+    if(stat(sourcePath.c_str(), &info) != 0){
+        return false;
+    }
+
+#ifdef __APPLE__
+    auto& modified = info.st_mtimespec;
+#else
+    auto& modified = info.st_mtim;
+#endif
+
+    key.size = (uint64_t)info.st_size;
+    key.modifiedTime = (int64_t)modified.tv_sec * 1000000000 + modified.tv_nsec;
+    key.pathHash = HashMeshCachePath(sourcePath);
+    return true;
+}
+
+inline uint64_t AlignMeshCacheOffset(uint64_t offset){
+    return (offset + 15) & ~(uint64_t)15;
+}
+
+// Checks the image is a complete cache of the given source and points view at its blobs
+inline bool ReadMeshCache(const char* data, size_t size, const MeshCacheKey& key, MeshCacheView& view){
+    if(size < sizeof(MeshCacheHeader)){
+        return false;
+    }
+
+    auto header = (const MeshCacheHeader*)data;
+    if(header->magic != meshCacheMagic || header->version != meshCacheVersion ||
+       header->key.size != key.size || header->key.modifiedTime != key.modifiedTime || header->key.pathHash != key.pathHash){
+        return false;
+    }
+
+    if(header->attributeCount > (uint32_t)meshCacheMaxAttributes ||
+       header->vertexOffset + header->vertexBytes > size || header->indexOffset + header->indexBytes > size ||
+       header->indexBytes != (uint64_t)header->indexCount * sizeof(uint32_t) ||
+       header->lodCount == 0 || header->lodCount > (uint32_t)meshLodMaxCount){
+        return false;
+    }
+
+    // Interleaved: every attribute steps by the same stride, see GetMeshCacheStride
+    if(header->attributeCount == 0 || header->attributes[0].stride == 0 ||
+       header->vertexBytes != (uint64_t)header->vertexCount * header->attributes[0].stride){
+        return false;
+    }
+    for(uint32_t i = 1; i < header->attributeCount; i++){
+        if(header->attributes[i].stride != header->attributes[0].stride){
+            return false;
+        }
+    }
+
+    for(uint32_t lod = 0; lod < header->lodCount; lod++){
+        if((uint64_t)header->lods[lod].firstIndex + header->lods[lod].indexCount > header->indexCount){
+            return false;
+        }
+    }
+
+    view.header = header;
+    view.vertexData = data + header->vertexOffset;
+    view.indexData = data + header->indexOffset;
+    return true;
+}
+
+inline uint32_t GetMeshCacheStride(const MeshCacheHeader& header){
+    return header.attributes[0].stride;
+}
+
+// Packs a unit normal into GL_INT_2_10_10_10_REV, signed normalized x, y, z and an unused w
+inline uint32_t PackMeshCacheNormal(float x, float y, float z){
+    auto pack = [](float value){
+        value = value < -1.0f ? -1.0f : value > 1.0f ? 1.0f : value;
+        return (uint32_t)((int32_t)roundf(value * 511.0f) & 0x3FF);
+    };
+    return pack(x) | (pack(y) << 10) | (pack(z) << 20);
+}
+
+// Builds the cache image of a mesh from UnifyObjVertices, with 32 bit indices: the mesh's own faces as LOD 0
+// followed by the given lower LODs, which use the same vertices. Vertices are always interleaved so meshes
+// of one format can share a vertex buffer. The quantized layout is 12 bytes per vertex: unorm16 x, y, z
+// (+ padding) relative to the bounds and a 10-10-10-2 normal. Otherwise float3 position and normal, 24 bytes.
+inline void BuildMeshCache(const ObjData& mesh, const MeshCacheKey& key, std::vector<char>& image, bool quantize = true,
+                           const std::vector<MeshLodLevel>& lods = std::vector<MeshLodLevel>()){
+    MeshCacheHeader header = {};
+    header.magic = meshCacheMagic;
+    header.version = meshCacheVersion;
+    header.key = key;
+
+    auto cacheStats = AnalyzeVertexCache(mesh);
+    header.acmr = cacheStats.acmr;
+    header.atvr = cacheStats.atvr;
+
+    auto vertexCount = mesh.vertices.size();
+    for(int axis = 0; axis < 3; axis++){
+        header.boundsMin[axis] = vertexCount > 0 ? 1e30f : 0.0f;
+        header.boundsMax[axis] = vertexCount > 0 ? -1e30f : 0.0f;
+    }
+    for(const auto& vertex : mesh.vertices){
+        float position[3] = { vertex.x, vertex.y, vertex.z };
+        for(int axis = 0; axis < 3; axis++){
+            header.boundsMin[axis] = position[axis] < header.boundsMin[axis] ? position[axis] : header.boundsMin[axis];
+            header.boundsMax[axis] = position[axis] > header.boundsMax[axis] ? position[axis] : header.boundsMax[axis];
+        }
+    }
+
+    auto vertexSize = quantize ? 4 * sizeof(uint16_t) + sizeof(uint32_t) : 6 * sizeof(float);
+    header.vertexCount = (uint32_t)vertexCount;
+    header.lodCount = 1;
+    header.lods[0] = MeshCacheLod{ 0, (uint32_t)(mesh.faces.size() * 3), 0.0f, 0 };
+    for(size_t i = 0; i < lods.size() && header.lodCount < (uint32_t)meshLodMaxCount; i++){
+        auto& previous = header.lods[header.lodCount - 1];
+        header.lods[header.lodCount++] = MeshCacheLod{ previous.firstIndex + previous.indexCount, (uint32_t)(lods[i].faces.size() * 3), lods[i].error, 0 };
+    }
+
+    auto& lastLod = header.lods[header.lodCount - 1];
+    header.indexCount = lastLod.firstIndex + lastLod.indexCount;
+    header.indexType = meshCacheUnsignedInt;
+    header.attributeCount = 2;
+    header.vertexOffset = AlignMeshCacheOffset(sizeof(MeshCacheHeader));
+    header.vertexBytes = vertexCount * vertexSize;
+    header.indexOffset = AlignMeshCacheOffset(header.vertexOffset + header.vertexBytes);
+    header.indexBytes = header.indexCount * sizeof(uint32_t);
+
+    image.assign(header.indexOffset + header.indexBytes, 0);
+    auto vertexData = image.data() + header.vertexOffset;
+
+    if(quantize){
+        header.attributes[0] = MeshCacheAttribute{ 0, 3, meshCacheUnsignedShort, 1, (uint32_t)vertexSize, 0 };
+        header.attributes[1] = MeshCacheAttribute{ 1, 4, meshCacheInt2101010Rev, 1, (uint32_t)vertexSize, 4 * sizeof(uint16_t) };
+
+        float inverseExtent[3];
+        for(int axis = 0; axis < 3; axis++){
+            auto extent = header.boundsMax[axis] - header.boundsMin[axis];
+            header.positionScale[axis] = extent;
+            header.positionOffset[axis] = header.boundsMin[axis];
+            inverseExtent[axis] = extent > 0.0f ? 1.0f / extent : 0.0f;
+        }
+
+        for(size_t i = 0; i < vertexCount; i++){
+            auto vertex = vertexData + i * vertexSize;
+            float position[3] = { mesh.vertices[i].x, mesh.vertices[i].y, mesh.vertices[i].z };
+            uint16_t quantized[4] = { 0, 0, 0, 0 };
+            for(int axis = 0; axis < 3; axis++){
+                auto unorm = (position[axis] - header.positionOffset[axis]) * inverseExtent[axis];
+                quantized[axis] = (uint16_t)roundf((unorm < 0.0f ? 0.0f : unorm > 1.0f ? 1.0f : unorm) * 65535.0f);
+            }
+
+            auto normal = PackMeshCacheNormal(mesh.normals[i].x, mesh.normals[i].y, mesh.normals[i].z);
+            memcpy(vertex, quantized, sizeof(quantized));
+            memcpy(vertex + sizeof(quantized), &normal, sizeof(normal));
+        }
+    }
+    else{
+        header.attributes[0] = MeshCacheAttribute{ 0, 3, meshCacheFloat, 0, (uint32_t)vertexSize, 0 };
+        header.attributes[1] = MeshCacheAttribute{ 1, 3, meshCacheFloat, 0, (uint32_t)vertexSize, 3 * sizeof(float) };
+
+        for(int axis = 0; axis < 3; axis++){
+            header.positionScale[axis] = 1.0f;
+            header.positionOffset[axis] = 0.0f;
+        }
+
+        auto floats = (float*)vertexData;
+        for(size_t i = 0; i < vertexCount; i++){
+            auto vertex = floats + i * 6;
+            vertex[0] = mesh.vertices[i].x;
+            vertex[1] = mesh.vertices[i].y;
+            vertex[2] = mesh.vertices[i].z;
+            vertex[3] = mesh.normals[i].x;
+            vertex[4] = mesh.normals[i].y;
+            vertex[5] = mesh.normals[i].z;
+        }
+    }
+
+    auto indices = (uint32_t*)(image.data() + header.indexOffset);
+    for(uint32_t lod = 0; lod < header.lodCount; lod++){
+        auto& faces = lod == 0 ? mesh.faces : lods[lod - 1].faces;
+        auto lodIndices = indices + header.lods[lod].firstIndex;
+        for(size_t i = 0; i < faces.size(); i++){
+            for(int c = 0; c < 3; c++){
+                lodIndices[i * 3 + c] = faces[i].vIndex[c];
+            }
+        }
+    }
+
+    memcpy(image.data(), &header, sizeof(header));
+}
+
+// Writes to a temporary file first so an interrupted run never leaves a truncated cache behind
+inline bool WriteCacheImage(const std::string& cachePath, const std::vector<char>& image){
+    auto tempPath = cachePath + ".tmp";
+    auto file = fopen(tempPath.c_str(), "wb");
+    if(file == nullptr){
+        return false;
+    }
+
+    auto written = fwrite(image.data(), 1, image.size(), file) == image.size();
+    if(fclose(file) != 0 || !written || rename(tempPath.c_str(), cachePath.c_str()) != 0){
+        remove(tempPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Parses an OBJ, optimizes its index order, simplifies it into LODs and builds its cache image, the processing
+// the asset cooker moves out of the game's startup. sourceStats receives the cache efficiency of the OBJ's own order.
+inline bool CookMesh(const std::string& sourcePath, const MeshCacheKey& key, std::vector<char>& image, int threadCount = 0, bool quantize = true,
+                     VertexCacheStats* sourceStats = nullptr){
+    ObjData data, mesh;
+    if(!ParseObjFile(sourcePath, data, threadCount) || !UnifyObjVertices(data, mesh)){
+        return false;
+    }
+
+    OptimizeMesh(mesh, sourceStats);
+
+    // The LODs reuse LOD 0's vertices (already in fetch order), only their own triangle order is optimized
+    auto lods = BuildMeshLods(mesh);
+    for(auto& lod : lods){
+        OptimizeVertexCache(lod.faces, mesh.vertices.size());
+    }
+
+    BuildMeshCache(mesh, key, image, quantize, lods);
+    return true;
+}
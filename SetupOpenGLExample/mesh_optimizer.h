@@ -0,0 +1,390 @@
+#pragma once
+
+// Index and vertex reordering for meshes from UnifyObjVertices (vIndex == tIndex == nIndex).
+// Has no GL/GLM dependency, used by the mesh cache and the asset cooker.
+//
+// The stages run in this order (see OptimizeMesh):
+//   OptimizeVertexCache - Forsyth's linear speed triangle order for the post-transform vertex cache
+//   OptimizeOverdraw    - splits that order into clusters and draws outward facing clusters first
+//   OptimizeVertexFetch - renumbers the vertices in the order the result uses them
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "obj_parser.h"
+
+// Renumbers the vertices in the order the index buffer first uses them, so the vertex fetches of
+// consecutive triangles read neighbouring memory. Vertices no face uses are dropped.
+inline void OptimizeVertexFetch(ObjData& mesh){
+    const unsigned int unused = (unsigned int)-1;
+    std::vector<unsigned int> remap(mesh.vertices.size(), unused);
+    unsigned int vertexCount = 0;
+
+    for(auto& face : mesh.faces){
+        for(int c = 0; c < 3; c++){
+            auto& index = remap[face.vIndex[c]];
+            if(index == unused){
+                index = vertexCount++;
+            }
+            face.vIndex[c] = face.tIndex[c] = face.nIndex[c] = index;
+        }
+    }
+
+    ObjData reordered;
+    reordered.vertices.resize(vertexCount, Vertex(0.0f, 0.0f, 0.0f));
+    reordered.normals.resize(vertexCount, Normal(0.0f, 0.0f, 0.0f));
+    if(!mesh.textures.empty()){
+        reordered.textures.resize(vertexCount, Texture(0.0f, 0.0f));
+    }
+
+    for(size_t i = 0; i < remap.size(); i++){
+        if(remap[i] == unused){
+            continue;
+        }
+        reordered.vertices[remap[i]] = mesh.vertices[i];
+        reordered.normals[remap[i]] = mesh.normals[i];
+        if(!mesh.textures.empty()){
+            reordered.textures[remap[i]] = mesh.textures[i];
+        }
+    }
+
+    mesh.vertices = std::move(reordered.vertices);
+    mesh.normals = std::move(reordered.normals);
+    mesh.textures = std::move(reordered.textures);
+}
+
+// Post-transform cache efficiency of a triangle order, simulated with a FIFO cache.
+// acmr: transformed vertices per triangle (0.5 is the ideal for a regular grid, 3 the worst).
+// atvr: transformed vertices per referenced vertex (1 is ideal).
+struct VertexCacheStats {
+    float acmr = 0.0f;
+    float atvr = 0.0f;
+};
+
+const int vertexCacheAnalyzeSize = 16;
+
+inline VertexCacheStats AnalyzeVertexCache(const ObjData& mesh, int cacheSize = vertexCacheAnalyzeSize){
+    VertexCacheStats stats;
+    if(mesh.faces.empty()){
+        return stats;
+    }
+
+    // A vertex is cached while fewer than cacheSize misses happened since its own
+    std::vector<int64_t> missTime(mesh.vertices.size(), -(int64_t)cacheSize - 1);
+    std::vector<bool> referenced(mesh.vertices.size(), false);
+    int64_t misses = 0;
+    size_t referencedCount = 0;
+
+    for(const auto& face : mesh.faces){
+        for(int c = 0; c < 3; c++){
+            auto v = face.vIndex[c];
+            if(misses - missTime[v] > cacheSize){
+                missTime[v] = misses++;
+            }
+            if(!referenced[v]){
+                referenced[v] = true;
+                referencedCount++;
+            }
+        }
+    }
+
+    stats.acmr = (float)misses / mesh.faces.size();
+    stats.atvr = (float)misses / referencedCount;
+    return stats;
+}
+
+const int vertexCacheOptimizeSize = 32;
+
+// Forsyth's vertex scores: recently used vertices score higher, except the last triangle's three which
+// would be reused by the next one anyway, and vertices with few remaining triangles are boosted so
+// they get finished instead of leaving isolated triangles behind. Tabulated, the scores are updated
+// for every cached vertex after every triangle.
+struct VertexCacheScores {
+    static const int maxValence = 64;
+    float cache[vertexCacheOptimizeSize + 1];
+    float valence[maxValence];
+
+    VertexCacheScores(){
+        for(int position = 0; position < vertexCacheOptimizeSize; position++){
+            cache[position + 1] = position < 3 ? 0.75f : powf(1.0f - (float)(position - 3) / (vertexCacheOptimizeSize - 3), 1.5f);
+        }
+        cache[0] = 0.0f;
+
+        valence[0] = 0.0f;
+        for(int remaining = 1; remaining < maxValence; remaining++){
+            valence[remaining] = 2.0f / sqrtf((float)remaining);
+        }
+    }
+
+    // cachePosition -1 is not cached
+    float Get(int cachePosition, uint32_t remainingTriangles) const {
+        if(remainingTriangles == 0){
+            return -1.0f;
+        }
+
+        auto valenceScore = remainingTriangles < (uint32_t)maxValence ? valence[remainingTriangles] : 2.0f / sqrtf((float)remainingTriangles);
+        return cache[cachePosition + 1] + valenceScore;
+    }
+};
+
+// Reorders the triangles for the post-transform vertex cache, greedily emitting the triangle whose
+// vertices score highest in a simulated LRU cache. Linear in the triangle count.
+inline void OptimizeVertexCache(std::vector<Face>& faces, size_t vertexCount){
+    auto faceCount = faces.size();
+    if(faceCount == 0){
+        return;
+    }
+
+    // Triangles around every vertex, as offsets into one array
+    std::vector<uint32_t> remaining(vertexCount, 0);
+    for(const auto& face : faces){
+        for(int c = 0; c < 3; c++){
+            remaining[face.vIndex[c]]++;
+        }
+    }
+
+    std::vector<uint32_t> adjacencyOffsets(vertexCount + 1, 0);
+    for(size_t v = 0; v < vertexCount; v++){
+        adjacencyOffsets[v + 1] = adjacencyOffsets[v] + remaining[v];
+    }
+
+    std::vector<uint32_t> adjacency(faceCount * 3);
+    std::vector<uint32_t> fill(adjacencyOffsets.begin(), adjacencyOffsets.end() - 1);
+    for(uint32_t f = 0; f < faceCount; f++){
+        for(int c = 0; c < 3; c++){
+            adjacency[fill[faces[f].vIndex[c]]++] = f;
+        }
+    }
+
+    static const VertexCacheScores scores;
+    std::vector<float> vertexScores(vertexCount);
+    for(size_t v = 0; v < vertexCount; v++){
+        vertexScores[v] = scores.Get(-1, remaining[v]);
+    }
+
+    std::vector<float> faceScores(faceCount);
+    for(size_t f = 0; f < faceCount; f++){
+        auto& face = faces[f];
+        faceScores[f] = vertexScores[face.vIndex[0]] + vertexScores[face.vIndex[1]] + vertexScores[face.vIndex[2]];
+    }
+
+    std::vector<bool> emitted(faceCount, false);
+    std::vector<uint32_t> cache, nextCache;
+    cache.reserve(vertexCacheOptimizeSize + 3);
+    nextCache.reserve(vertexCacheOptimizeSize + 3);
+
+    std::vector<Face> result;
+    result.reserve(faceCount);
+
+    size_t scanPosition = 0;
+    auto best = -1;
+
+    while(result.size() < faceCount){
+        // Nothing in the cache has triangles left, continue with the next triangle in the input order
+        if(best == -1){
+            while(emitted[scanPosition]){
+                scanPosition++;
+            }
+            best = (int)scanPosition;
+        }
+
+        auto& face = faces[best];
+        result.push_back(face);
+        emitted[best] = true;
+
+        // The triangle's vertices move to the front of the cache, the rest keep their order
+        nextCache.clear();
+        for(int c = 0; c < 3; c++){
+            nextCache.push_back(face.vIndex[c]);
+        }
+        for(auto v : cache){
+            if(v != face.vIndex[0] && v != face.vIndex[1] && v != face.vIndex[2]){
+                nextCache.push_back(v);
+            }
+        }
+
+        // Remove the triangle from its vertices' adjacency lists
+        for(int c = 0; c < 3; c++){
+            auto v = face.vIndex[c];
+            auto begin = adjacency.begin() + adjacencyOffsets[v];
+            auto end = begin + remaining[v];
+            std::iter_swap(std::find(begin, end, (uint32_t)best), end - 1);
+            remaining[v]--;
+        }
+
+        // Update the scores of everything in or just pushed out of the cache and pick the next triangle
+        // among their triangles
+        auto bestScore = -1.0f;
+        best = -1;
+        for(size_t i = 0; i < nextCache.size(); i++){
+            auto v = nextCache[i];
+            auto position = i < (size_t)vertexCacheOptimizeSize ? (int)i : -1;
+
+            auto score = scores.Get(position, remaining[v]);
+            auto delta = score - vertexScores[v];
+            vertexScores[v] = score;
+
+            for(uint32_t a = 0; a < remaining[v]; a++){
+                auto f = adjacency[adjacencyOffsets[v] + a];
+                faceScores[f] += delta;
+                if(faceScores[f] > bestScore){
+                    bestScore = faceScores[f];
+                    best = (int)f;
+                }
+            }
+        }
+
+        if(nextCache.size() > (size_t)vertexCacheOptimizeSize){
+            nextCache.resize(vertexCacheOptimizeSize);
+        }
+        std::swap(cache, nextCache);
+    }
+
+    faces = std::move(result);
+}
+
+const float overdrawThreshold = 1.05f;
+
+// Reorders clusters of the vertex cache optimized triangle order so the outward facing parts of the mesh
+// are drawn first and occlude the rest earlier (Sander et al., "Fast Triangle Reordering for Vertex Locality
+// and Reduced Overdraw"). Clusters start where the cache would be cold anyway, or where restarting costs at
+// most threshold times the cluster's own ACMR, so the vertex cache efficiency is mostly kept.
+inline void OptimizeOverdraw(ObjData& mesh, float threshold = overdrawThreshold){
+    auto faceCount = mesh.faces.size();
+    if(faceCount == 0){
+        return;
+    }
+
+    std::vector<int64_t> missTime(mesh.vertices.size(), INT64_MIN / 2);
+    int64_t misses = 0;
+    auto CountMisses = [&](const Face& face){
+        auto faceMisses = 0;
+        for(int c = 0; c < 3; c++){
+            auto v = face.vIndex[c];
+            if(misses - missTime[v] > vertexCacheAnalyzeSize){
+                missTime[v] = misses++;
+                faceMisses++;
+            }
+        }
+        return faceMisses;
+    };
+    auto ResetCache = [&](){
+        misses += vertexCacheAnalyzeSize + 1;
+    };
+
+    // Hard boundaries: triangles whose three vertices all miss
+    std::vector<uint32_t> hardBoundaries;
+    for(uint32_t f = 0; f < faceCount; f++){
+        if(CountMisses(mesh.faces[f]) == 3){
+            hardBoundaries.push_back(f);
+        }
+    }
+    hardBoundaries.push_back((uint32_t)faceCount);
+
+    // Soft boundaries inside every hard cluster
+    std::vector<uint32_t> clusterStarts;
+    for(size_t h = 0; h + 1 < hardBoundaries.size(); h++){
+        auto start = hardBoundaries[h];
+        auto end = hardBoundaries[h + 1];
+
+        ResetCache();
+        auto clusterMisses = 0;
+        for(auto f = start; f < end; f++){
+            clusterMisses += CountMisses(mesh.faces[f]);
+        }
+        auto clusterAcmr = (float)clusterMisses / (end - start);
+
+        ResetCache();
+        clusterStarts.push_back(start);
+        auto segmentStart = start;
+        auto segmentMisses = 0;
+        for(auto f = start; f < end; f++){
+            segmentMisses += CountMisses(mesh.faces[f]);
+
+            if(f + 1 < end && (float)segmentMisses / (f + 1 - segmentStart) <= threshold * clusterAcmr){
+                segmentStart = f + 1;
+                segmentMisses = 0;
+                clusterStarts.push_back(segmentStart);
+                ResetCache();
+            }
+        }
+    }
+    clusterStarts.push_back((uint32_t)faceCount);
+
+    // Area weighted centroid and normal of every cluster, and of the whole mesh
+    auto clusterCount = clusterStarts.size() - 1;
+    std::vector<float> clusterData(clusterCount * 6, 0.0f);
+    float meshCentroid[3] = { 0.0f, 0.0f, 0.0f };
+    auto meshArea = 0.0f;
+
+    for(size_t i = 0; i < clusterCount; i++){
+        auto centroid = &clusterData[i * 6];
+        auto normal = centroid + 3;
+        auto clusterArea = 0.0f;
+
+        for(auto f = clusterStarts[i]; f < clusterStarts[i + 1]; f++){
+            auto& face = mesh.faces[f];
+            auto& a = mesh.vertices[face.vIndex[0]];
+            auto& b = mesh.vertices[face.vIndex[1]];
+            auto& c = mesh.vertices[face.vIndex[2]];
+            float ab[3] = { b.x - a.x, b.y - a.y, b.z - a.z };
+            float ac[3] = { c.x - a.x, c.y - a.y, c.z - a.z };
+            float n[3] = { ab[1] * ac[2] - ab[2] * ac[1], ab[2] * ac[0] - ab[0] * ac[2], ab[0] * ac[1] - ab[1] * ac[0] };
+            auto area = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+            float faceCentroid[3] = { (a.x + b.x + c.x) / 3.0f, (a.y + b.y + c.y) / 3.0f, (a.z + b.z + c.z) / 3.0f };
+
+            for(int axis = 0; axis < 3; axis++){
+                centroid[axis] += faceCentroid[axis] * area;
+                normal[axis] += n[axis];
+                meshCentroid[axis] += faceCentroid[axis] * area;
+            }
+            clusterArea += area;
+        }
+
+        meshArea += clusterArea;
+        auto normalLength = sqrtf(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+        for(int axis = 0; axis < 3; axis++){
+            centroid[axis] = clusterArea > 0.0f ? centroid[axis] / clusterArea : 0.0f;
+            normal[axis] = normalLength > 0.0f ? normal[axis] / normalLength : 0.0f;
+        }
+    }
+
+    for(int axis = 0; axis < 3; axis++){
+        meshCentroid[axis] = meshArea > 0.0f ? meshCentroid[axis] / meshArea : 0.0f;
+    }
+
+    // Clusters far out along their own normal are likely in front of the rest from most view directions
+    std::vector<float> sortKeys(clusterCount);
+    std::vector<uint32_t> order(clusterCount);
+    for(size_t i = 0; i < clusterCount; i++){
+        auto centroid = &clusterData[i * 6];
+        auto normal = centroid + 3;
+        sortKeys[i] = (centroid[0] - meshCentroid[0]) * normal[0] + (centroid[1] - meshCentroid[1]) * normal[1] + (centroid[2] - meshCentroid[2]) * normal[2];
+        order[i] = (uint32_t)i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b){ return sortKeys[a] > sortKeys[b]; });
+
+    std::vector<Face> result;
+    result.reserve(faceCount);
+    for(auto i : order){
+        result.insert(result.end(), mesh.faces.begin() + clusterStarts[i], mesh.faces.begin() + clusterStarts[i + 1]);
+    }
+    mesh.faces = std::move(result);
+}
+
+// All stages, reporting the cache efficiency of the input and the result when stats are given
+inline void OptimizeMesh(ObjData& mesh, VertexCacheStats* before = nullptr, VertexCacheStats* after = nullptr){
+    if(before){
+        *before = AnalyzeVertexCache(mesh);
+    }
+
+    OptimizeVertexCache(mesh.faces, mesh.vertices.size());
+    OptimizeOverdraw(mesh);
+    OptimizeVertexFetch(mesh);
+
+    if(after){
+        *after = AnalyzeVertexCache(mesh);
+    }
+}
@@ -0,0 +1,338 @@
+#pragma once
+
+// Quadric error metric simplification (Garland and Heckbert) for the LOD chain of a mesh.
+// Has no GL/GLM dependency, used by the mesh cache and the asset cooker.
+//
+// Only the index buffer is simplified: an edge collapse moves one vertex onto the other, so every LOD
+// reuses the vertex buffer of the full mesh and a LOD is just a range of the shared index buffer.
+// Vertices on open borders and on attribute seams (a position shared by several vertices) never move,
+// so the simplified mesh doesn't tear.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "obj_parser.h"
+
+struct MeshLodLevel {
+    std::vector<Face> faces;
+    // Largest distance (object space, approximate) between the simplified and the full surface
+    float error = 0.0f;
+};
+
+// Symmetric 4x4 matrix of the squared distance to a set of planes, weighted by area.
+// weight is the total area, Evaluate / weight is the mean squared distance.
+struct Quadric {
+    double a00 = 0, a01 = 0, a02 = 0, a03 = 0;
+    double a11 = 0, a12 = 0, a13 = 0;
+    double a22 = 0, a23 = 0;
+    double a33 = 0;
+    double weight = 0;
+
+    void AddPlane(double x, double y, double z, double d, double area){
+        a00 += area * x * x; a01 += area * x * y; a02 += area * x * z; a03 += area * x * d;
+        a11 += area * y * y; a12 += area * y * z; a13 += area * y * d;
+        a22 += area * z * z; a23 += area * z * d;
+        a33 += area * d * d;
+        weight += area;
+    }
+
+    void Add(const Quadric& q){
+        a00 += q.a00; a01 += q.a01; a02 += q.a02; a03 += q.a03;
+        a11 += q.a11; a12 += q.a12; a13 += q.a13;
+        a22 += q.a22; a23 += q.a23;
+        a33 += q.a33;
+        weight += q.weight;
+    }
+
+    double Evaluate(const Vertex& p) const {
+        double x = p.x, y = p.y, z = p.z;
+        auto error = a00 * x * x + 2 * a01 * x * y + 2 * a02 * x * z + 2 * a03 * x +
+                     a11 * y * y + 2 * a12 * y * z + 2 * a13 * y +
+                     a22 * z * z + 2 * a23 * z + a33;
+        return error > 0.0 ? error : 0.0;
+    }
+};
+
+inline void GetFaceNormal(const Vertex& a, const Vertex& b, const Vertex& c, double normal[3]){
+    double ab[3] = { (double)b.x - a.x, (double)b.y - a.y, (double)b.z - a.z };
+    double ac[3] = { (double)c.x - a.x, (double)c.y - a.y, (double)c.z - a.z };
+    normal[0] = ab[1] * ac[2] - ab[2] * ac[1];
+    normal[1] = ab[2] * ac[0] - ab[0] * ac[2];
+    normal[2] = ab[0] * ac[1] - ab[1] * ac[0];
+}
+
+// Edge key with the smaller vertex first
+inline uint64_t GetEdgeKey(uint32_t a, uint32_t b){
+    return a < b ? ((uint64_t)a << 32) | b : ((uint64_t)b << 32) | a;
+}
+
+// Vertices that must keep their position: open border vertices and vertices sharing their position
+inline std::vector<bool> GetLockedVertices(const std::vector<Vertex>& positions, const std::vector<Face>& faces){
+    auto vertexCount = positions.size();
+    std::vector<bool> locked(vertexCount, false);
+
+    // Vertices with the same position, found by sorting
+    std::vector<uint32_t> byPosition(vertexCount);
+    for(uint32_t v = 0; v < vertexCount; v++){
+        byPosition[v] = v;
+    }
+    auto less = [&](uint32_t a, uint32_t b){
+        auto& p = positions[a];
+        auto& q = positions[b];
+        return p.x != q.x ? p.x < q.x : p.y != q.y ? p.y < q.y : p.z < q.z;
+    };
+    std::sort(byPosition.begin(), byPosition.end(), less);
+
+    for(size_t i = 1; i < vertexCount; i++){
+        if(!less(byPosition[i - 1], byPosition[i])){
+            locked[byPosition[i - 1]] = true;
+            locked[byPosition[i]] = true;
+        }
+    }
+
+    // Edges used by a single triangle are on a border
+    std::vector<uint64_t> edges;
+    edges.reserve(faces.size() * 3);
+    for(const auto& face : faces){
+        for(int c = 0; c < 3; c++){
+            edges.push_back(GetEdgeKey(face.vIndex[c], face.vIndex[(c + 1) % 3]));
+        }
+    }
+    std::sort(edges.begin(), edges.end());
+
+    for(size_t i = 0; i < edges.size();){
+        auto j = i + 1;
+        while(j < edges.size() && edges[j] == edges[i]){
+            j++;
+        }
+        if(j - i == 1){
+            locked[(uint32_t)(edges[i] >> 32)] = true;
+            locked[(uint32_t)edges[i]] = true;
+        }
+        i = j;
+    }
+
+    return locked;
+}
+
+// Collapses edges of sourceFaces in order of their quadric error until at most targetFaceCount triangles
+// remain or no edge can be collapsed anymore. Each pass collapses the cheapest edges that don't touch the
+// ring of another collapse of the pass and don't flip any triangle around the moved vertex.
+// The error is relative to sourceFaces.
+inline MeshLodLevel SimplifyMesh(const std::vector<Vertex>& positions, const std::vector<Face>& sourceFaces, size_t targetFaceCount){
+    auto vertexCount = positions.size();
+    MeshLodLevel result;
+    result.faces = sourceFaces;
+
+    auto locked = GetLockedVertices(positions, sourceFaces);
+
+    std::vector<Quadric> quadrics(vertexCount);
+    for(const auto& face : sourceFaces){
+        double normal[3];
+        GetFaceNormal(positions[face.vIndex[0]], positions[face.vIndex[1]], positions[face.vIndex[2]], normal);
+        auto length = sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+        if(length == 0.0){
+            continue;
+        }
+
+        auto& p = positions[face.vIndex[0]];
+        double n[3] = { normal[0] / length, normal[1] / length, normal[2] / length };
+        auto d = -(n[0] * p.x + n[1] * p.y + n[2] * p.z);
+        auto area = length * 0.5;
+        for(int c = 0; c < 3; c++){
+            quadrics[face.vIndex[c]].AddPlane(n[0], n[1], n[2], d, area);
+        }
+    }
+
+    struct Collapse {
+        uint32_t from, to;
+        double cost;
+    };
+
+    std::vector<uint64_t> edges;
+    std::vector<Collapse> collapses;
+    std::vector<uint32_t> adjacencyOffsets, adjacency;
+    std::vector<bool> touched(vertexCount);
+    std::vector<uint32_t> remap(vertexCount);
+    std::vector<uint32_t> ring, common;
+    auto maxError = 0.0;
+
+    while(result.faces.size() > targetFaceCount){
+        auto& faces = result.faces;
+
+        edges.clear();
+        for(const auto& face : faces){
+            for(int c = 0; c < 3; c++){
+                edges.push_back(GetEdgeKey(face.vIndex[c], face.vIndex[(c + 1) % 3]));
+            }
+        }
+        std::sort(edges.begin(), edges.end());
+        edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+
+        // The cheaper direction of every edge, moving an unlocked vertex onto the other one
+        collapses.clear();
+        for(auto edge : edges){
+            auto a = (uint32_t)(edge >> 32);
+            auto b = (uint32_t)edge;
+            Quadric q = quadrics[a];
+            q.Add(quadrics[b]);
+
+            auto weight = q.weight > 0.0 ? q.weight : 1.0;
+            auto costAB = locked[a] ? INFINITY : q.Evaluate(positions[b]) / weight;
+            auto costBA = locked[b] ? INFINITY : q.Evaluate(positions[a]) / weight;
+            if(costAB == INFINITY && costBA == INFINITY){
+                continue;
+            }
+            collapses.push_back(costAB <= costBA ? Collapse{ a, b, costAB } : Collapse{ b, a, costBA });
+        }
+        if(collapses.empty()){
+            break;
+        }
+        std::sort(collapses.begin(), collapses.end(), [](const Collapse& x, const Collapse& y){ return x.cost < y.cost; });
+
+        // Triangles around every vertex, for the flip test
+        adjacencyOffsets.assign(vertexCount + 1, 0);
+        for(const auto& face : faces){
+            for(int c = 0; c < 3; c++){
+                adjacencyOffsets[face.vIndex[c] + 1]++;
+            }
+        }
+        for(size_t v = 0; v < vertexCount; v++){
+            adjacencyOffsets[v + 1] += adjacencyOffsets[v];
+        }
+        adjacency.resize(faces.size() * 3);
+        std::vector<uint32_t> fill(adjacencyOffsets.begin(), adjacencyOffsets.end() - 1);
+        for(uint32_t f = 0; f < faces.size(); f++){
+            for(int c = 0; c < 3; c++){
+                adjacency[fill[faces[f].vIndex[c]]++] = f;
+            }
+        }
+
+        std::fill(touched.begin(), touched.end(), false);
+        for(uint32_t v = 0; v < vertexCount; v++){
+            remap[v] = v;
+        }
+
+        // Every collapse removes about two triangles, stop the pass when that would reach the target
+        auto faceBudget = (faces.size() - targetFaceCount + 1) / 2;
+        size_t collapseCount = 0;
+
+        for(const auto& collapse : collapses){
+            if(collapseCount >= faceBudget){
+                break;
+            }
+            if(touched[collapse.from] || touched[collapse.to]){
+                continue;
+            }
+
+            // Moving "from" onto "to" must not flip the triangles that keep existing
+            auto flips = false;
+            for(auto i = adjacencyOffsets[collapse.from]; i < adjacencyOffsets[collapse.from + 1] && !flips; i++){
+                auto& face = faces[adjacency[i]];
+                if(face.vIndex[0] == collapse.to || face.vIndex[1] == collapse.to || face.vIndex[2] == collapse.to){
+                    continue;
+                }
+
+                double before[3], after[3];
+                Vertex moved[3] = { positions[face.vIndex[0]], positions[face.vIndex[1]], positions[face.vIndex[2]] };
+                GetFaceNormal(moved[0], moved[1], moved[2], before);
+                for(int c = 0; c < 3; c++){
+                    if(face.vIndex[c] == collapse.from){
+                        moved[c] = positions[collapse.to];
+                    }
+                }
+                GetFaceNormal(moved[0], moved[1], moved[2], after);
+
+                auto dot = before[0] * after[0] + before[1] * after[1] + before[2] * after[2];
+                auto lengths = sqrt(before[0] * before[0] + before[1] * before[1] + before[2] * before[2]) *
+                               sqrt(after[0] * after[0] + after[1] * after[1] + after[2] * after[2]);
+                flips = dot <= 0.25 * lengths;
+            }
+            if(flips){
+                continue;
+            }
+
+            // Link condition: the edge's two opposite vertices may be the only neighbours both ends share,
+            // otherwise the collapse folds the surface onto itself
+            ring.clear();
+            for(auto i = adjacencyOffsets[collapse.from]; i < adjacencyOffsets[collapse.from + 1]; i++){
+                auto& face = faces[adjacency[i]];
+                ring.insert(ring.end(), face.vIndex, face.vIndex + 3);
+            }
+            std::sort(ring.begin(), ring.end());
+            ring.erase(std::unique(ring.begin(), ring.end()), ring.end());
+
+            common.clear();
+            for(auto i = adjacencyOffsets[collapse.to]; i < adjacencyOffsets[collapse.to + 1]; i++){
+                auto& face = faces[adjacency[i]];
+                for(int c = 0; c < 3; c++){
+                    auto v = face.vIndex[c];
+                    if(v != collapse.from && v != collapse.to && std::binary_search(ring.begin(), ring.end(), v)){
+                        common.push_back(v);
+                    }
+                }
+            }
+            std::sort(common.begin(), common.end());
+            if(std::unique(common.begin(), common.end()) - common.begin() > 2){
+                continue;
+            }
+
+            // The flip test assumed the ring around "from" stays put, so nothing in it may move in this pass
+            for(auto i = adjacencyOffsets[collapse.from]; i < adjacencyOffsets[collapse.from + 1]; i++){
+                auto& face = faces[adjacency[i]];
+                touched[face.vIndex[0]] = touched[face.vIndex[1]] = touched[face.vIndex[2]] = true;
+            }
+
+            remap[collapse.from] = collapse.to;
+            quadrics[collapse.to].Add(quadrics[collapse.from]);
+            maxError = std::max(maxError, collapse.cost);
+            collapseCount++;
+        }
+
+        if(collapseCount == 0){
+            break;
+        }
+
+        // Apply the pass, triangles that lost an edge disappear
+        size_t kept = 0;
+        for(auto face : faces){
+            for(int c = 0; c < 3; c++){
+                face.vIndex[c] = face.tIndex[c] = face.nIndex[c] = remap[face.vIndex[c]];
+            }
+            if(face.vIndex[0] != face.vIndex[1] && face.vIndex[1] != face.vIndex[2] && face.vIndex[0] != face.vIndex[2]){
+                faces[kept++] = face;
+            }
+        }
+        faces.erase(faces.begin() + kept, faces.end());
+    }
+
+    // Collapse costs are mean squared distances
+    result.error = (float)sqrt(maxError);
+    return result;
+}
+
+const int meshLodMaxCount = 4;
+
+// LOD 1 to 3 at half, a quarter and an eighth of the triangles, each simplified from the previous one
+// (so its error adds up). Stops early when the mesh can't get much simpler (a cube is all seams), so
+// small meshes get fewer levels.
+inline std::vector<MeshLodLevel> BuildMeshLods(const ObjData& mesh){
+    std::vector<MeshLodLevel> lods;
+    auto previous = &mesh.faces;
+    auto previousError = 0.0f;
+
+    for(int lod = 1; lod < meshLodMaxCount; lod++){
+        auto level = SimplifyMesh(mesh.vertices, *previous, mesh.faces.size() >> lod);
+        if(level.faces.empty() || level.faces.size() > previous->size() * 3 / 4){
+            break;
+        }
+
+        level.error += previousError;
+        previousError = level.error;
+        lods.push_back(std::move(level));
+        previous = &lods.back().faces;
+    }
+    return lods;
+}
@@ -0,0 +1,670 @@
+#pragma once
+
+// OBJ parsing on a memory mapped file with a hand written number scanner.
+// Has no GL/GLM dependency so it can be benchmarked standalone (see bench_obj_parser.cpp).
+//
+// The file is split into line aligned chunks that are parsed on separate threads, each chunk is
+// scanned twice: the first pass only counts the v/vn/vt/f lines so the vectors are allocated once,
+// the second pass parses them. The chunks are merged in file order.
+//
+// Faces may be v, v/t, v//n or v/t/n and have any number of corners, polygons are fan triangulated.
+// UnifyObjVertices then turns the result into one vertex per distinct corner for a single index buffer.
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct Vertex
+{
+    Vertex(float inX, float inY, float inZ) : x(inX), y(inY), z(inZ) { }
+    float x, y, z;
+};
+
+struct Texture
+{
+    Texture(float inU, float inV) : u(inU), v(inV) { }
+    float u, v;
+};
+
+struct Normal
+{
+    Normal(float inX, float inY, float inZ) : x(inX), y(inY), z(inZ) { }
+    float x, y, z;
+};
+
+struct Face
+{
+    Face(int v[], int t[], int n[]) {
+        vIndex[0] = v[0];
+        vIndex[1] = v[1];
+        vIndex[2] = v[2];
+        tIndex[0] = t[0];
+        tIndex[1] = t[1];
+        tIndex[2] = t[2];
+        nIndex[0] = n[0];
+        nIndex[1] = n[1];
+        nIndex[2] = n[2];
+    }
+    unsigned int vIndex[3], tIndex[3], nIndex[3];
+};
+
+struct ObjData {
+    std::vector<Vertex> vertices;
+    std::vector<Normal> normals;
+    std::vector<Texture> textures;
+    std::vector<Face> faces;
+};
+
+// Read only view of a whole file, unmapped when destroyed.
+struct MappedFile {
+    const char* data = nullptr;
+    size_t size = 0;
+
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile(){
+        Close();
+    }
+
+    bool Open(const std::string& path){
+        Close();
+
+        auto fd = open(path.c_str(), O_RDONLY);
+        if(fd == -1){
+            return false;
+        }
+
+        struct stat info;
+        if(fstat(fd, &info) != 0){
+            close(fd);
+            return false;
+        }
+
+        size = (size_t)info.st_size;
+
+        // mmap doesn't accept a zero length, an empty file is still a valid (empty) OBJ
+        if(size == 0){
+            close(fd);
+            data = "";
+            return true;
+        }
+
+        auto mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+
+        if(mapping == MAP_FAILED){
+            size = 0;
+            return false;
+        }
+
+        // The file is read front to back once per pass
+        madvise(mapping, size, MADV_SEQUENTIAL);
+        data = (const char*)mapping;
+        return true;
+    }
+
+    void Close(){
+        if(size > 0){
+            munmap((void*)data, size);
+        }
+        data = nullptr;
+        size = 0;
+    }
+};
+
+// The scanners below never read past end, the mapped file is not null terminated.
+
+inline bool IsObjSpace(char c){
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+inline bool IsObjDigit(char c){
+    return (unsigned)(c - '0') < 10u;
+}
+
+inline const char* SkipObjSpaces(const char* p, const char* end){
+    while(p < end && IsObjSpace(*p)){
+        p++;
+    }
+    return p;
+}
+
+inline const char* SkipObjLine(const char* p, const char* end){
+    auto newline = (const char*)memchr(p, '\n', end - p);
+    return newline ? newline + 1 : end;
+}
+
+inline double GetPowerOf10(int exponent){
+    // Exactly representable as doubles, anything else falls back to pow
+    static const double table[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+    };
+
+    if(exponent >= 0 && exponent <= 22){
+        return table[exponent];
+    }
+    if(exponent < 0 && exponent >= -22){
+        return 1.0 / table[-exponent];
+    }
+    return pow(10.0, exponent);
+}
+
+// [-+]digits[.digits][(e|E)[-+]digits], returns nullptr when there is no number at p.
+inline const char* ScanObjFloat(const char* p, const char* end, float& value){
+    p = SkipObjSpaces(p, end);
+
+    auto negative = false;
+    if(p < end && (*p == '-' || *p == '+')){
+        negative = *p == '-';
+        p++;
+    }
+
+    uint64_t mantissa = 0;
+    auto exponent = 0;
+    auto digitCount = 0;
+    auto anyDigit = false;
+
+    // Digits beyond the 19th don't fit the mantissa and only move the exponent, floats need far fewer
+    for(; p < end && IsObjDigit(*p); p++){
+        if(digitCount < 19){
+            mantissa = mantissa * 10 + (*p - '0');
+            digitCount += mantissa != 0;
+        }
+        else{
+            exponent++;
+        }
+        anyDigit = true;
+    }
+
+    if(p < end && *p == '.'){
+        p++;
+        for(; p < end && IsObjDigit(*p); p++){
+            if(digitCount < 19){
+                mantissa = mantissa * 10 + (*p - '0');
+                digitCount += mantissa != 0;
+                exponent--;
+            }
+            anyDigit = true;
+        }
+    }
+
+    if(!anyDigit){
+        return nullptr;
+    }
+
+    if(p < end && (*p == 'e' || *p == 'E')){
+        auto q = p + 1;
+        auto negativeExponent = false;
+        if(q < end && (*q == '-' || *q == '+')){
+            negativeExponent = *q == '-';
+            q++;
+        }
+
+        if(q < end && IsObjDigit(*q)){
+            auto e = 0;
+            for(; q < end && IsObjDigit(*q); q++){
+                e = e < 10000 ? e * 10 + (*q - '0') : e;
+            }
+            exponent += negativeExponent ? -e : e;
+            p = q;
+        }
+    }
+
+    auto result = exponent < 0 ? (double)mantissa / GetPowerOf10(-exponent) : (double)mantissa * GetPowerOf10(exponent);
+    value = (float)(negative ? -result : result);
+    return p;
+}
+
+// [-+]digits, returns nullptr when there is no number at p.
+inline const char* ScanObjInt(const char* p, const char* end, int& value){
+    auto negative = false;
+    if(p < end && (*p == '-' || *p == '+')){
+        negative = *p == '-';
+        p++;
+    }
+
+    if(p == end || !IsObjDigit(*p)){
+        return nullptr;
+    }
+
+    auto result = 0;
+    for(; p < end && IsObjDigit(*p); p++){
+        result = result * 10 + (*p - '0');
+    }
+
+    value = negative ? -result : result;
+    return p;
+}
+
+// One face corner: v, v/t, v//n or v/t/n. Missing indices are 0, which becomes -1 after the OBJ 1-based
+// indices are made 0-based.
+inline const char* ScanObjFaceCorner(const char* p, const char* end, int& v, int& t, int& n){
+    p = SkipObjSpaces(p, end);
+    t = 0;
+    n = 0;
+
+    p = ScanObjInt(p, end, v);
+    if(p == nullptr || p == end || *p != '/'){
+        return p;
+    }
+
+    p++;
+    if(p < end && *p != '/'){
+        p = ScanObjInt(p, end, t);
+        if(p == nullptr){
+            return nullptr;
+        }
+    }
+
+    if(p < end && *p == '/'){
+        p = ScanObjInt(p + 1, end, n);
+    }
+
+    return p;
+}
+
+enum ObjLineType {
+    ObjLineOther,
+    ObjLineVertex,
+    ObjLineTexture,
+    ObjLineNormal,
+    ObjLineFace,
+};
+
+// p is the start of a line (after leading spaces), the keyword is skipped through keywordEnd.
+inline ObjLineType GetObjLineType(const char* p, const char* end, const char*& keywordEnd){
+    if(end - p < 2){
+        return ObjLineOther;
+    }
+
+    if(p[0] == 'v'){
+        if(IsObjSpace(p[1])){
+            keywordEnd = p + 1;
+            return ObjLineVertex;
+        }
+        if(end - p >= 3 && IsObjSpace(p[2])){
+            keywordEnd = p + 2;
+            if(p[1] == 'n') return ObjLineNormal;
+            if(p[1] == 't') return ObjLineTexture;
+        }
+        return ObjLineOther;
+    }
+
+    if(p[0] == 'f' && IsObjSpace(p[1])){
+        keywordEnd = p + 1;
+        return ObjLineFace;
+    }
+
+    return ObjLineOther;
+}
+
+struct ObjCounts {
+    size_t vertices = 0;
+    size_t textures = 0;
+    size_t normals = 0;
+    size_t faces = 0;
+};
+
+inline ObjCounts CountObjLines(const char* p, const char* end){
+    ObjCounts counts;
+
+    while(p < end){
+        auto lineStart = SkipObjSpaces(p, end);
+        const char* keywordEnd;
+
+        switch(GetObjLineType(lineStart, end, keywordEnd)){
+            case ObjLineVertex: counts.vertices++; break;
+            case ObjLineTexture: counts.textures++; break;
+            case ObjLineNormal: counts.normals++; break;
+            case ObjLineFace: counts.faces++; break;
+            default: break;
+        }
+
+        p = SkipObjLine(lineStart, end);
+    }
+
+    return counts;
+}
+
+// Parse result of one chunk of the file. Negative (relative) face indices refer to the elements defined
+// before the face in the whole file, which a chunk doesn't know, so they are stored relative to the start
+// of the chunk and listed in relativeSlots until the merge adds the counts of the previous chunks.
+struct ObjChunk {
+    ObjData data;
+    // face * 9 + kind * 3 + corner, kind 0: vIndex, 1: tIndex, 2: nIndex
+    std::vector<uint32_t> relativeSlots;
+    bool succeeded = false;
+};
+
+// OBJ indices are 1-based, negative ones count back from the last element defined so far.
+// 0 (a missing texture/normal index) becomes -1.
+inline unsigned int ResolveObjIndex(int index, size_t countSoFar, bool& relative){
+    relative = index < 0;
+    return relative ? (unsigned int)(countSoFar + index) : (unsigned int)(index - 1);
+}
+
+// Parses the v, vt, vn and f lines of [begin, end), everything else is ignored.
+// succeeded is false on a malformed number.
+inline void ParseObjChunk(const char* begin, const char* end, ObjChunk& chunk){
+    auto& result = chunk.data;
+    auto counts = CountObjLines(begin, end);
+    result.vertices.reserve(counts.vertices);
+    result.textures.reserve(counts.textures);
+    result.normals.reserve(counts.normals);
+    result.faces.reserve(counts.faces);
+
+    auto p = begin;
+
+    while(p < end){
+        auto lineStart = SkipObjSpaces(p, end);
+        const char* q;
+        float c1, c2, c3;
+
+        switch(GetObjLineType(lineStart, end, q)){
+            case ObjLineVertex:
+                if(!(q = ScanObjFloat(q, end, c1)) || !(q = ScanObjFloat(q, end, c2)) || !(q = ScanObjFloat(q, end, c3))){
+                    return;
+                }
+                result.vertices.push_back(Vertex(c1, c2, c3));
+                break;
+
+            case ObjLineTexture:
+                if(!(q = ScanObjFloat(q, end, c1)) || !(q = ScanObjFloat(q, end, c2))){
+                    return;
+                }
+                result.textures.push_back(Texture(c1, c2));
+                break;
+
+            case ObjLineNormal:
+                if(!(q = ScanObjFloat(q, end, c1)) || !(q = ScanObjFloat(q, end, c2)) || !(q = ScanObjFloat(q, end, c3))){
+                    return;
+                }
+                result.normals.push_back(Normal(c1, c2, c3));
+                break;
+
+            case ObjLineFace: {
+                // Polygons are fan triangulated around the first corner. Slot 0 holds the first corner,
+                // slots 1 and 2 the last two, every corner from the third on completes a triangle.
+                int vIndex[3], tIndex[3], nIndex[3];
+                bool relative[3][3];
+                auto cornerCount = 0;
+
+                while(true){
+                    q = SkipObjSpaces(q, end);
+                    if(q == end || *q == '\n' || *q == '#'){
+                        break;
+                    }
+
+                    int v, t, n;
+                    if(!(q = ScanObjFaceCorner(q, end, v, t, n))){
+                        return;
+                    }
+
+                    auto slot = cornerCount < 3 ? cornerCount : 2;
+                    if(cornerCount >= 3){
+                        vIndex[1] = vIndex[2];
+                        tIndex[1] = tIndex[2];
+                        nIndex[1] = nIndex[2];
+                        memcpy(relative[1], relative[2], sizeof(relative[2]));
+                    }
+
+                    vIndex[slot] = ResolveObjIndex(v, result.vertices.size(), relative[slot][0]);
+                    tIndex[slot] = ResolveObjIndex(t, result.textures.size(), relative[slot][1]);
+                    nIndex[slot] = ResolveObjIndex(n, result.normals.size(), relative[slot][2]);
+                    cornerCount++;
+
+                    if(cornerCount < 3){
+                        continue;
+                    }
+
+                    auto face = (uint32_t)result.faces.size();
+                    for(int c = 0; c < 3; c++){
+                        for(int kind = 0; kind < 3; kind++){
+                            if(relative[c][kind]){
+                                chunk.relativeSlots.push_back(face * 9 + kind * 3 + c);
+                            }
+                        }
+                    }
+                    result.faces.push_back(Face(vIndex, tIndex, nIndex));
+                }
+
+                // A face needs at least a triangle
+                if(cornerCount < 3){
+                    return;
+                }
+                break;
+            }
+
+            default:
+                break;
+        }
+
+        p = SkipObjLine(lineStart, end);
+    }
+
+    chunk.succeeded = true;
+}
+
+// Chunk boundaries are always just after a newline, so no line is split.
+inline std::vector<const char*> SplitObjChunks(const char* begin, const char* end, int chunkCount){
+    std::vector<const char*> bounds;
+    bounds.push_back(begin);
+
+    auto size = (size_t)(end - begin);
+    for(int i = 1; i < chunkCount; i++){
+        auto target = begin + size / chunkCount * i;
+        bounds.push_back(SkipObjLine(target > bounds.back() ? target : bounds.back(), end));
+    }
+
+    bounds.push_back(end);
+    return bounds;
+}
+
+// Below this a single thread is faster than starting the others
+const size_t objParallelMinBytes = 4 * 1024 * 1024;
+
+// threadCount 0 uses every hardware thread. Returns false on a malformed number.
+inline bool ParseObjBuffer(const char* begin, const char* end, ObjData& result, int threadCount = 0){
+    if(threadCount <= 0){
+        threadCount = (int)std::thread::hardware_concurrency();
+    }
+    if(threadCount <= 0 || (size_t)(end - begin) < objParallelMinBytes){
+        threadCount = 1;
+    }
+
+    auto bounds = SplitObjChunks(begin, end, threadCount);
+    std::vector<ObjChunk> chunks(threadCount);
+
+    // The calling thread parses the first chunk
+    std::vector<std::thread> threads;
+    for(int i = 1; i < threadCount; i++){
+        threads.emplace_back(ParseObjChunk, bounds[i], bounds[i + 1], std::ref(chunks[i]));
+    }
+    ParseObjChunk(bounds[0], bounds[1], chunks[0]);
+    for(auto& thread : threads){
+        thread.join();
+    }
+
+    ObjCounts total;
+    for(const auto& chunk : chunks){
+        if(!chunk.succeeded){
+            return false;
+        }
+        total.vertices += chunk.data.vertices.size();
+        total.textures += chunk.data.textures.size();
+        total.normals += chunk.data.normals.size();
+        total.faces += chunk.data.faces.size();
+    }
+
+    result.vertices.reserve(result.vertices.size() + total.vertices);
+    result.textures.reserve(result.textures.size() + total.textures);
+    result.normals.reserve(result.normals.size() + total.normals);
+    result.faces.reserve(result.faces.size() + total.faces);
+
+    for(auto& chunk : chunks){
+        auto& data = chunk.data;
+
+        // Everything already merged was defined before this chunk
+        unsigned int bases[3] = { (unsigned int)result.vertices.size(), (unsigned int)result.textures.size(), (unsigned int)result.normals.size() };
+        for(auto slot : chunk.relativeSlots){
+            auto& face = data.faces[slot / 9];
+            auto kind = slot % 9 / 3;
+            auto corner = slot % 3;
+            auto indices = kind == 0 ? face.vIndex : kind == 1 ? face.tIndex : face.nIndex;
+            indices[corner] += bases[kind];
+        }
+
+        result.vertices.insert(result.vertices.end(), data.vertices.begin(), data.vertices.end());
+        result.textures.insert(result.textures.end(), data.textures.begin(), data.textures.end());
+        result.normals.insert(result.normals.end(), data.normals.begin(), data.normals.end());
+        result.faces.insert(result.faces.end(), data.faces.begin(), data.faces.end());
+        data = ObjData();
+    }
+
+    return true;
+}
+
+inline bool ParseObjFile(const std::string& path, ObjData& result, int threadCount = 0){
+    MappedFile file;
+    if(!file.Open(path)){
+        return false;
+    }
+
+    return ParseObjBuffer(file.data, file.data + file.size, result, threadCount);
+}
+
+// Hash map from a (v, t, n) corner to its unified vertex. The bucket is the position index itself:
+// faces mostly refer to nearby positions so lookups stay in cache, and a bucket only chains the few
+// texture coordinate/normal combinations of its position, however faceted the mesh is.
+struct ObjCornerMap {
+    struct Corner {
+        unsigned int t, n;
+        int next;
+    };
+
+    std::vector<int> heads;
+    std::vector<Corner> corners;
+
+    explicit ObjCornerMap(size_t positionCount){
+        heads.assign(positionCount, -1);
+        corners.reserve(positionCount);
+    }
+
+    // Returns the vertex of the corner, or adds a vertex and returns it. Vertices are numbered in insertion order.
+    int FindOrInsert(unsigned int v, unsigned int t, unsigned int n){
+        for(auto i = heads[v]; i != -1; i = corners[i].next){
+            if(corners[i].t == t && corners[i].n == n){
+                return i;
+            }
+        }
+
+        auto vertex = (int)corners.size();
+        corners.push_back(Corner{ t, n, heads[v] });
+        heads[v] = vertex;
+        return vertex;
+    }
+};
+
+// Turns the separately indexed positions, texture coordinates and normals into one vertex per distinct
+// (v, t, n) corner, so a single index buffer addresses all attributes. In the result every face has
+// vIndex == tIndex == nIndex, there is one normal per vertex, and one texture coordinate per vertex unless
+// the OBJ has none. Corners without a normal get the area weighted normal of the faces around their position.
+// Returns false when a face refers to an element that doesn't exist.
+inline bool UnifyObjVertices(const ObjData& obj, ObjData& result){
+    const unsigned int missing = (unsigned int)-1;
+    auto hasTextures = !obj.textures.empty();
+
+    for(const auto& face : obj.faces){
+        for(int c = 0; c < 3; c++){
+            if(face.vIndex[c] >= obj.vertices.size() ||
+               (face.tIndex[c] != missing && face.tIndex[c] >= obj.textures.size()) ||
+               (face.nIndex[c] != missing && face.nIndex[c] >= obj.normals.size())){
+                return false;
+            }
+        }
+    }
+
+    ObjCornerMap corners(obj.vertices.size());
+    std::vector<unsigned int> positionOfVertex;
+    std::vector<unsigned int> normalOfVertex;
+    positionOfVertex.reserve(obj.vertices.size());
+    normalOfVertex.reserve(obj.vertices.size());
+
+    result = ObjData();
+    result.faces.reserve(obj.faces.size());
+
+    for(const auto& face : obj.faces){
+        int indices[3];
+        for(int c = 0; c < 3; c++){
+            indices[c] = corners.FindOrInsert(face.vIndex[c], face.tIndex[c], face.nIndex[c]);
+
+            if(indices[c] == (int)positionOfVertex.size()){
+                positionOfVertex.push_back(face.vIndex[c]);
+                normalOfVertex.push_back(face.nIndex[c]);
+
+                if(hasTextures){
+                    auto t = face.tIndex[c];
+                    result.textures.push_back(t != missing ? obj.textures[t] : Texture(0.0f, 0.0f));
+                }
+            }
+        }
+        result.faces.push_back(Face(indices, indices, indices));
+    }
+
+    // Unnormalized face normals have the length of twice the area, summing them weights by area
+    std::vector<Normal> generatedNormals;
+    for(auto normal : normalOfVertex){
+        if(normal != missing){
+            continue;
+        }
+
+        generatedNormals.assign(obj.vertices.size(), Normal(0.0f, 0.0f, 0.0f));
+        for(const auto& face : obj.faces){
+            auto& a = obj.vertices[face.vIndex[0]];
+            auto& b = obj.vertices[face.vIndex[1]];
+            auto& c = obj.vertices[face.vIndex[2]];
+            float ab[3] = { b.x - a.x, b.y - a.y, b.z - a.z };
+            float ac[3] = { c.x - a.x, c.y - a.y, c.z - a.z };
+            float n[3] = { ab[1] * ac[2] - ab[2] * ac[1], ab[2] * ac[0] - ab[0] * ac[2], ab[0] * ac[1] - ab[1] * ac[0] };
+
+            for(int corner = 0; corner < 3; corner++){
+                auto& sum = generatedNormals[face.vIndex[corner]];
+                sum.x += n[0];
+                sum.y += n[1];
+                sum.z += n[2];
+            }
+        }
+        break;
+    }
+
+    auto vertexCount = positionOfVertex.size();
+    result.vertices.reserve(vertexCount);
+    result.normals.reserve(vertexCount);
+
+    for(size_t i = 0; i < vertexCount; i++){
+        result.vertices.push_back(obj.vertices[positionOfVertex[i]]);
+
+        if(normalOfVertex[i] != missing){
+            result.normals.push_back(obj.normals[normalOfVertex[i]]);
+            continue;
+        }
+
+        auto n = generatedNormals[positionOfVertex[i]];
+        auto length = sqrtf(n.x * n.x + n.y * n.y + n.z * n.z);
+        result.normals.push_back(length > 0.0f ? Normal(n.x / length, n.y / length, n.z / length) : Normal(0.0f, 1.0f, 0.0f));
+    }
+
+    return true;
+}
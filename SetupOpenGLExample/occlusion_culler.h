@@ -0,0 +1,104 @@
+#pragma once
+
+// Occlusion test against a hierarchical depth buffer (Hi-Z) on the CPU.
+// Has no GL/GLM dependency, main.cpp builds the first levels on the GPU, reads the smallest one back and
+// hands it to HiZBuffer::Build, which reduces it further down to 1x1.
+//
+// Every texel holds the farthest depth (window space, 0 near, 1 far) of the pixels it covers, so a
+// rectangle is occluded when its nearest depth is behind the farthest depth of every texel it touches.
+
+#include <cstddef>
+#include <vector>
+
+struct HiZBuffer {
+    std::vector<std::vector<float>> levels;
+    std::vector<int> widths;
+    std::vector<int> heights;
+
+    bool Empty() const {
+        return levels.empty();
+    }
+
+    // Farthest of the 2x2 texels under every texel of the next level, odd sizes also take the 3rd
+    // row/column so the last texel still covers the whole source
+    static void Reduce(const float* source, int width, int height, float* target, int targetWidth, int targetHeight){
+        auto extraX = width & 1;
+        auto extraY = height & 1;
+
+        for(int y = 0; y < targetHeight; y++){
+            for(int x = 0; x < targetWidth; x++){
+                auto depth = 0.0f;
+                for(int sy = y * 2; sy <= y * 2 + 1 + extraY; sy++){
+                    for(int sx = x * 2; sx <= x * 2 + 1 + extraX; sx++){
+                        auto value = source[(sy < height ? sy : height - 1) * width + (sx < width ? sx : width - 1)];
+                        depth = value > depth ? value : depth;
+                    }
+                }
+                target[y * targetWidth + x] = depth;
+            }
+        }
+    }
+
+    // depth is width x height, rows bottom up like glReadPixels returns them
+    void Build(const float* depth, int width, int height){
+        levels.clear();
+        widths.clear();
+        heights.clear();
+        if(width <= 0 || height <= 0){
+            return;
+        }
+
+        levels.push_back(std::vector<float>(depth, depth + width * height));
+        widths.push_back(width);
+        heights.push_back(height);
+
+        while(width > 1 || height > 1){
+            auto targetWidth = width > 1 ? width / 2 : 1;
+            auto targetHeight = height > 1 ? height / 2 : 1;
+            std::vector<float> target(targetWidth * targetHeight);
+            Reduce(levels.back().data(), width, height, target.data(), targetWidth, targetHeight);
+
+            levels.push_back(std::move(target));
+            widths.push_back(targetWidth);
+            heights.push_back(targetHeight);
+            width = targetWidth;
+            height = targetHeight;
+        }
+    }
+
+    // Rectangle in normalized [0, 1] coordinates of the buffer, nearestDepth in window space. Samples the
+    // level where the rectangle spans at most 2x2 texels.
+    bool IsOccluded(float minX, float minY, float maxX, float maxY, float nearestDepth) const {
+        if(levels.empty()){
+            return false;
+        }
+
+        // Odd sizes make the last texel of a level cover more than its share, one more texel on the max side
+        // keeps the rectangle conservative
+        auto clamp = [](int value, int limit){ return value < 0 ? 0 : value >= limit ? limit - 1 : value; };
+        int x0 = clamp((int)(minX * widths[0]), widths[0]);
+        int y0 = clamp((int)(minY * heights[0]), heights[0]);
+        int x1 = clamp((int)(maxX * widths[0]) + 1, widths[0]);
+        int y1 = clamp((int)(maxY * heights[0]) + 1, heights[0]);
+
+        // A texel of level + 1 covers texels 2x and 2x + 1 (and 2x + 2 on an odd last column) of level
+        size_t level = 0;
+        while(level + 1 < levels.size() && (x1 - x0 > 1 || y1 - y0 > 1)){
+            level++;
+            x0 = x0 / 2 < widths[level] ? x0 / 2 : widths[level] - 1;
+            y0 = y0 / 2 < heights[level] ? y0 / 2 : heights[level] - 1;
+            x1 = x1 / 2 < widths[level] ? x1 / 2 : widths[level] - 1;
+            y1 = y1 / 2 < heights[level] ? y1 / 2 : heights[level] - 1;
+        }
+
+        auto& depth = levels[level];
+        for(int y = y0; y <= y1; y++){
+            for(int x = x0; x <= x1; x++){
+                if(depth[y * widths[level] + x] >= nearestDepth){
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+};
@@ -0,0 +1,58 @@
+// Shared by every shader, CreateShader inserts this after the #version line and the defines (vertex shaders
+// also get VERTEX_SHADER).
+// Declarations a shader doesn't use cost nothing.
+
+// Per-frame constants, written once per frame (binding point 0). Mirrors struct FrameData in main.cpp.
+layout(std140) uniform FrameData {
+    mat4 projection;
+    mat4 view;
+    mat4 inverseViewProjection;
+    vec3 cameraPos;
+    int clusteredLighting;
+    ivec4 clusterGrid;  // tile size in pixels, tiles x, tiles y, depth slices
+    vec4 clusterDepth;  // near, far, (slices - 1) / log(far / near)
+    int lightCount;
+};
+
+#ifdef VERTEX_SHADER
+// Mesh positions may be quantized relative to the mesh bounds, see SetMeshUniforms. A multi-draw
+// indirect call mixes meshes, there the decoding comes with every instance (see IndirectInstance).
+#ifdef INDIRECT_DRAW
+layout(location = 6) in vec3 positionScale;
+layout(location = 7) in vec3 positionOffset;
+#else
+uniform vec3 positionScale;
+uniform vec3 positionOffset;
+#endif
+
+vec3 DecodePosition(vec3 position){
+    return position * positionScale + positionOffset;
+}
+#endif
+
+#ifdef COMPACT_GBUFFER
+// Compact gbuffer encoding: frag_deferred_geometry.glsl writes the normal with OctEncode, the lighting
+// shaders decode it and rebuild the position from the depth buffer
+vec2 SignNotZero(vec2 v){
+    return vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+}
+
+// Unit vector to [-1, 1]^2, the lower hemisphere is folded over the diagonals of the octahedron
+vec2 OctEncode(vec3 n){
+    n /= abs(n.x) + abs(n.y) + abs(n.z);
+    return n.z >= 0.0 ? n.xy : (1.0 - abs(n.yx)) * SignNotZero(n.xy);
+}
+
+vec3 OctDecode(vec2 e){
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    float t = max(-n.z, 0.0);
+    n.xy += vec2(n.x >= 0.0 ? -t : t, n.y >= 0.0 ? -t : t);
+    return normalize(n);
+}
+
+// uv in [0, 1] over the gbuffer, depth as stored in the depth buffer. Only as accurate as the depth, see Camera::near.
+vec3 ReconstructPosition(vec2 uv, float depth){
+    vec4 world = inverseViewProjection * vec4(vec3(uv, depth) * 2.0 - 1.0, 1.0);
+    return world.xyz / world.w;
+}
+#endif
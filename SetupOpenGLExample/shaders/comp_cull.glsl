@@ -0,0 +1,82 @@
+#version 430 core
+
+// GPU driven culling, one invocation per object record (see GpuCullScene). Frustum culls the record's
+// bounding sphere, picks its LOD like SelectLod and appends the instance to the indirect command of that
+// mesh and LOD. The commands come in with instanceCount 0 and are drawn by DrawObjectsGpuCulled.
+layout(local_size_x = 64) in;
+
+struct CullRecord {
+    mat4 model;
+    uint meshIndex;
+};
+
+struct CullMesh {
+    vec4 sphere;          // object space center, radius
+    vec4 lodErrors;       // object space simplification error of each LOD
+    vec4 positionScale;
+    vec4 positionOffset;
+    uint firstCommand;    // command of LOD 0, the other LODs follow
+    uint lodCount;
+};
+
+struct DrawCommand {
+    uint count;
+    uint instanceCount;
+    uint firstIndex;
+    int baseVertex;
+    uint baseInstance;
+};
+
+// Same layout as IndirectInstance, read by the INDIRECT_DRAW vertex shaders
+struct Instance {
+    mat4 model;
+    vec4 positionScale;
+    vec4 positionOffset;
+};
+
+layout(std430, binding = 0) readonly buffer Records { CullRecord records[]; };
+layout(std430, binding = 1) readonly buffer Meshes { CullMesh meshes[]; };
+layout(std430, binding = 2) buffer Commands { DrawCommand commands[]; };
+layout(std430, binding = 3) writeonly buffer Instances { Instance instances[]; };
+
+uniform int recordCount;
+uniform int cullingEnabled;
+uniform vec4 frustumPlanes[6];
+// Pixels per unit of object space error at distance 1, divided by the largest allowed error. 0 disables LODs.
+uniform float lodErrorScale;
+uniform float cameraNear;
+
+void main()
+{
+    uint recordIndex = gl_GlobalInvocationID.x;
+    if(recordIndex >= uint(recordCount)){
+        return;
+    }
+
+    CullRecord record = records[recordIndex];
+    CullMesh mesh = meshes[record.meshIndex];
+
+    float scale = max(length(record.model[0].xyz), max(length(record.model[1].xyz), length(record.model[2].xyz)));
+    vec3 center = (record.model * vec4(mesh.sphere.xyz, 1.0)).xyz;
+    float radius = mesh.sphere.w * scale;
+
+    if(cullingEnabled != 0){
+        for(int i = 0; i < 6; i++){
+            if(dot(frustumPlanes[i].xyz, center) + frustumPlanes[i].w < -radius){
+                return;
+            }
+        }
+    }
+
+    uint lod = 0u;
+    if(lodErrorScale > 0.0){
+        float distance = max(length(center - cameraPos) - radius, cameraNear);
+        while(lod + 1u < mesh.lodCount && mesh.lodErrors[lod + 1u] * scale * lodErrorScale <= distance){
+            lod++;
+        }
+    }
+
+    uint commandIndex = mesh.firstCommand + lod;
+    uint slot = atomicAdd(commands[commandIndex].instanceCount, 1u);
+    instances[commands[commandIndex].baseInstance + slot] = Instance(record.model, mesh.positionScale, mesh.positionOffset);
+}
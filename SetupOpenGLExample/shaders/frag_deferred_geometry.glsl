@@ -1,7 +1,13 @@
 #version 410 core
+#ifdef COMPACT_GBUFFER
+// Position is reconstructed from the depth buffer, the normal is octahedral encoded into two channels
+layout (location = 0) out vec2 gNormal;
+layout (location = 1) out vec4 gAlbedoSpec;
+#else
 layout (location = 0) out vec3 gPosition;
 layout (location = 1) out vec3 gNormal;
 layout (location = 2) out vec4 gAlbedoSpec;
+#endif
 
 // in vec2 TexCoords;
 in vec3 FragPos;
@@ -15,10 +21,14 @@ vec3 ks = vec3(0.8, 0.8, 0.8);   // specular reflectance coefficient
 
 void main()
 {
+#ifdef COMPACT_GBUFFER
+    gNormal = OctEncode(normalize(Normal));
+#else
     // store the fragment position vector in the first gbuffer texture
     gPosition = FragPos;
     // also store the per-fragment normals into the gbuffer
     gNormal = normalize(Normal);
+#endif
     
     // and the diffuse per-fragment color
     // gAlbedoSpec.rgb = texture(texture_diffuse1, TexCoords).rgb;
@@ -3,16 +3,17 @@ out vec4 FragColor;
 
 in vec2 TexCoords;
 
+#ifdef COMPACT_GBUFFER
+uniform sampler2D gDepth;
+#else
 uniform sampler2D gPosition;
+#endif
 uniform sampler2D gNormal;
 uniform sampler2D gAlbedoSpec;
 
-const int maxLightCount = 256;
-
-uniform vec3 lightPositions[maxLightCount];
-uniform vec3 lightIntensities[maxLightCount];
-uniform vec3 cameraPos;
-uniform int lightCount;
+// Written once per frame by UpdateLightData, one texel per light, sized to the current light count
+uniform samplerBuffer lightPositions;   // xyz: position, w: influence radius
+uniform samplerBuffer lightIntensities;
 
 vec3 Iamb = vec3(0.8, 0.8, 0.8); // ambient light intensity
 vec3 ka = vec3(0.3, 0.3, 0.3);   // ambient reflectance coefficient
@@ -25,19 +26,25 @@ float distancesq(vec3 a, vec3 b){
 void main()
 {
     // retrieve data from gbuffer
+#ifdef COMPACT_GBUFFER
+    vec3 FragPos = ReconstructPosition(TexCoords, texture(gDepth, TexCoords).r);
+    vec3 Normal = OctDecode(texture(gNormal, TexCoords).rg);
+#else
     vec3 FragPos = texture(gPosition, TexCoords).rgb;
     vec3 Normal = texture(gNormal, TexCoords).rgb;
-    vec3 Diffuse = texture(gAlbedoSpec, TexCoords).rgb;
-    vec3 Specular = vec3(texture(gAlbedoSpec, TexCoords).a);
+#endif
+    vec4 AlbedoSpec = texture(gAlbedoSpec, TexCoords);
+    vec3 Diffuse = AlbedoSpec.rgb;
+    vec3 Specular = vec3(AlbedoSpec.a);
     
     vec3 totalDiffuse = vec3(0, 0, 0);
     vec3 totalSpecular = vec3(0, 0, 0);
     
     for(int i = 0; i < lightCount; ++i)
     {
-        vec3 lightPos = lightPositions[i];
+        vec3 lightPos = texelFetch(lightPositions, i).xyz;
         float dsq = distancesq(lightPos, FragPos);
-        vec3 I = lightIntensities[i] / dsq;
+        vec3 I = texelFetch(lightIntensities, i).xyz / dsq;
         vec3 L = normalize(lightPos - FragPos);
         vec3 V = normalize(cameraPos - FragPos);
         vec3 H = normalize(L + V);
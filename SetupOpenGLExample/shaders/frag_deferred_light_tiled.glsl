@@ -0,0 +1,80 @@
+#version 410 core
+out vec4 FragColor;
+
+in vec2 TexCoords;
+
+#ifdef COMPACT_GBUFFER
+uniform sampler2D gDepth;
+#else
+uniform sampler2D gPosition;
+#endif
+uniform sampler2D gNormal;
+uniform sampler2D gAlbedoSpec;
+
+// Built on the CPU every frame (BuildTileLightGrid), one (offset, count) pair per screen tile
+// pointing into the light index list.
+uniform usamplerBuffer tileLightGrid;
+uniform usamplerBuffer tileLightIndices;
+uniform int tileSize;
+uniform int tilesX;
+
+// Written once per frame by UpdateLightData, one texel per light, sized to the current light count
+uniform samplerBuffer lightPositions;   // xyz: position, w: influence radius
+uniform samplerBuffer lightIntensities;
+
+float distancesq(vec3 a, vec3 b){
+    vec3 diff = a - b;
+    return dot(diff, diff);
+}
+
+void main()
+{
+    // retrieve data from gbuffer
+#ifdef COMPACT_GBUFFER
+    vec3 FragPos = ReconstructPosition(TexCoords, texture(gDepth, TexCoords).r);
+    vec3 Normal = OctDecode(texture(gNormal, TexCoords).rg);
+#else
+    vec3 FragPos = texture(gPosition, TexCoords).rgb;
+    vec3 Normal = texture(gNormal, TexCoords).rgb;
+#endif
+    vec4 AlbedoSpec = texture(gAlbedoSpec, TexCoords);
+    vec3 Diffuse = AlbedoSpec.rgb;
+    vec3 Specular = vec3(AlbedoSpec.a);
+    
+    vec3 totalDiffuse = vec3(0, 0, 0);
+    vec3 totalSpecular = vec3(0, 0, 0);
+    
+    ivec2 tile = ivec2(gl_FragCoord.xy) / tileSize;
+    uvec2 cell = texelFetch(tileLightGrid, tile.y * tilesX + tile.x).rg;
+    
+    vec3 V = normalize(cameraPos - FragPos);
+    vec3 N = normalize(Normal);
+    
+    for(uint k = 0u; k < cell.y; ++k)
+    {
+        int i = int(texelFetch(tileLightIndices, int(cell.x + k)).r);
+        vec4 light = texelFetch(lightPositions, i);
+        vec3 lightPos = light.xyz;
+        float radius = light.w;
+        float dsq = distancesq(lightPos, FragPos);
+        
+        // Same cutoff the tiles were binned with, keeps the result independent of the tile size
+        if(dsq > radius * radius)
+            continue;
+        
+        vec3 I = texelFetch(lightIntensities, i).xyz / dsq;
+        vec3 L = normalize(lightPos - FragPos);
+        vec3 H = normalize(L + V);
+        
+        float NdotL = dot(N, L); // for diffuse component
+        float NdotH = dot(N, H); // for specular component
+
+        vec3 diffuseColor = I * Diffuse * max(0, NdotL);
+        vec3 specularColor = I * Specular * pow(max(0, NdotH), 100);
+        
+        totalDiffuse += diffuseColor;
+        totalSpecular += specularColor;
+    }
+    
+    FragColor = vec4(totalDiffuse + totalSpecular, 1);
+}
@@ -0,0 +1,61 @@
+#version 410 core
+out vec4 FragColor;
+
+flat in int lightIndex;
+
+#ifdef COMPACT_GBUFFER
+uniform sampler2D gDepth;
+#else
+uniform sampler2D gPosition;
+#endif
+uniform sampler2D gNormal;
+uniform sampler2D gAlbedoSpec;
+
+// Written once per frame by UpdateLightData, one texel per light, sized to the current light count
+uniform samplerBuffer lightPositions;   // xyz: position, w: influence radius
+uniform samplerBuffer lightIntensities;
+
+float distancesq(vec3 a, vec3 b){
+    vec3 diff = a - b;
+    return dot(diff, diff);
+}
+
+// Shades a single light for the pixels covered by its volume, results are added with GL_ONE, GL_ONE blending.
+void main()
+{
+    // The gbuffer has the same size as the framebuffer, so the fragment coordinate is the gbuffer texel
+    ivec2 texel = ivec2(gl_FragCoord.xy);
+#ifdef COMPACT_GBUFFER
+    vec2 uv = (vec2(texel) + 0.5) / vec2(textureSize(gDepth, 0));
+    vec3 FragPos = ReconstructPosition(uv, texelFetch(gDepth, texel, 0).r);
+    vec3 Normal = OctDecode(texelFetch(gNormal, texel, 0).rg);
+#else
+    vec3 FragPos = texelFetch(gPosition, texel, 0).rgb;
+    vec3 Normal = texelFetch(gNormal, texel, 0).rgb;
+#endif
+    vec4 AlbedoSpec = texelFetch(gAlbedoSpec, texel, 0);
+    vec3 Diffuse = AlbedoSpec.rgb;
+    vec3 Specular = vec3(AlbedoSpec.a);
+    
+    vec4 light = texelFetch(lightPositions, lightIndex);
+    vec3 lightPos = light.xyz;
+    float dsq = distancesq(lightPos, FragPos);
+    
+    // The volume only bounds the light in screen space and depth, the pixel may still be outside the radius
+    if(dsq > light.w * light.w)
+        discard;
+    
+    vec3 I = texelFetch(lightIntensities, lightIndex).xyz / dsq;
+    vec3 L = normalize(lightPos - FragPos);
+    vec3 V = normalize(cameraPos - FragPos);
+    vec3 H = normalize(L + V);
+    vec3 N = normalize(Normal);
+    
+    float NdotL = dot(N, L); // for diffuse component
+    float NdotH = dot(N, H); // for specular component
+
+    vec3 diffuseColor = I * Diffuse * max(0, NdotL);
+    vec3 specularColor = I * Specular * pow(max(0, NdotH), 100);
+    
+    FragColor = vec4(diffuseColor + specularColor, 1);
+}
@@ -0,0 +1,6 @@
+#version 410 core
+
+// Stencil pass of the light volumes, only the depth test result is needed so nothing is written.
+void main()
+{
+}
@@ -11,12 +11,14 @@ vec3 kd = vec3(0.2, 0.2, 0.2);     // diffuse reflectance coefficient
 vec3 ka = vec3(0.3, 0.3, 0.3);   // ambient reflectance coefficient
 vec3 ks = vec3(0.8, 0.8, 0.8);   // specular reflectance coefficient
 
-const int maxLightCount = 256;
+// Written once per frame by UpdateLightData, one texel per light, sized to the current light count
+uniform samplerBuffer lightPositions;   // xyz: position, w: influence radius
+uniform samplerBuffer lightIntensities;
 
-uniform vec3 lightPositions[maxLightCount];
-uniform vec3 lightIntensities[maxLightCount];
-uniform vec3 cameraPos;
-uniform int lightCount;
+// Clustered light assignment, built on the CPU every frame (BuildLightGrid). One (offset, count) pair
+// per cluster pointing into the light index list. Only read when clusteredLighting is set.
+uniform usamplerBuffer clusterLightGrid;
+uniform usamplerBuffer clusterLightIndices;
 
 in vec4 fragWorldPos;
 in vec3 fragWorldNor;
@@ -28,6 +30,33 @@ float distancesq(vec3 a, vec3 b){
     return dot(diff, diff);
 }
 
+// Must match GetClusterSlice in main.cpp. Slice 0 is everything closer than clusterDepth.x,
+// the rest is split exponentially up to clusterDepth.y.
+int GetClusterIndex(vec3 pos){
+    float depth = -(view * vec4(pos, 1)).z;
+    int slice = 0;
+    if(depth >= clusterDepth.x){
+        slice = min(1 + int(log(depth / clusterDepth.x) * clusterDepth.z), clusterGrid.w - 1);
+    }
+    
+    ivec2 tile = ivec2(gl_FragCoord.xy) / clusterGrid.x;
+    return (slice * clusterGrid.z + tile.y) * clusterGrid.y + tile.x;
+}
+
+void AddLight(int i, vec3 pos, vec3 N, vec3 V, inout vec3 totalDiffuse, inout vec3 totalSpecular){
+    vec3 lightPos = texelFetch(lightPositions, i).xyz;
+    float dsq = distancesq(lightPos, pos);
+    vec3 I = texelFetch(lightIntensities, i).xyz / dsq;
+    vec3 L = normalize(lightPos - pos);
+    vec3 H = normalize(L + V);
+
+    float NdotL = dot(N, L); // for diffuse component
+    float NdotH = dot(N, H); // for specular component
+
+    totalDiffuse += I * kd * max(0, NdotL);
+    totalSpecular += I * ks * pow(max(0, NdotH), 100);
+}
+
 // Compute lighting. We assume lightPos and eyePos are in world
 // coordinates. fragWorldPos and fragWorldNor are the interpolated
 // coordinates by the rasterizer.
@@ -36,24 +65,28 @@ void main(void)
     vec3 totalDiffuse = vec3(0, 0, 0);
     vec3 totalSpecular = vec3(0, 0, 0);
     
-    for(int i = 0; i < lightCount; i++){
-        vec3 lightPos = lightPositions[i];
-        vec3 pos = vec3(fragWorldPos);
-        float dsq = distancesq(lightPos, pos);
-        vec3 I = lightIntensities[i] / dsq;
-        vec3 L = normalize(lightPos - pos);
-        vec3 V = normalize(cameraPos - pos);
-        vec3 H = normalize(L + V);
-        vec3 N = normalize(fragWorldNor);
-
-        float NdotL = dot(N, L); // for diffuse component
-        float NdotH = dot(N, H); // for specular component
-
-        vec3 diffuseColor = I * kd * max(0, NdotL);
-        vec3 specularColor = I * ks * pow(max(0, NdotH), 100);
+    vec3 pos = vec3(fragWorldPos);
+    vec3 V = normalize(cameraPos - pos);
+    vec3 N = normalize(fragWorldNor);
+    
+    if(clusteredLighting != 0){
+        uvec2 cluster = texelFetch(clusterLightGrid, GetClusterIndex(pos)).rg;
         
-        totalDiffuse += diffuseColor;
-        totalSpecular += specularColor;
+        for(uint k = 0u; k < cluster.y; k++){
+            int i = int(texelFetch(clusterLightIndices, int(cluster.x + k)).r);
+            vec4 light = texelFetch(lightPositions, i);
+            
+            // Same cutoff the clusters were built with
+            if(distancesq(light.xyz, pos) > light.w * light.w)
+                continue;
+            
+            AddLight(i, pos, N, V, totalDiffuse, totalSpecular);
+        }
+    }
+    else{
+        for(int i = 0; i < lightCount; i++){
+            AddLight(i, pos, N, V, totalDiffuse, totalSpecular);
+        }
     }
     
     // vec3 ambientColor = Iamb * ka;
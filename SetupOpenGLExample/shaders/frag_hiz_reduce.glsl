@@ -0,0 +1,25 @@
+#version 410 core
+
+// One level of the Hi-Z pyramid, see BuildHiZ. Every texel keeps the farthest depth of the 2x2 source
+// texels it covers, plus the 3rd row/column of an odd sized source (same rule as HiZBuffer::Reduce).
+// The source is the gbuffer depth or the previous level, limited to that level with GL_TEXTURE_BASE_LEVEL.
+uniform sampler2D hiZSource;
+
+out float depth;
+
+void main()
+{
+    ivec2 sourceSize = textureSize(hiZSource, 0);
+    ivec2 extra = sourceSize & 1;
+    ivec2 base = ivec2(gl_FragCoord.xy) * 2;
+
+    float farthest = 0.0;
+    for(int y = 0; y <= 1 + extra.y; y++){
+        for(int x = 0; x <= 1 + extra.x; x++){
+            ivec2 texel = min(base + ivec2(x, y), sourceSize - 1);
+            farthest = max(farthest, texelFetch(hiZSource, texel, 0).r);
+        }
+    }
+
+    depth = farthest;
+}
@@ -8,12 +8,11 @@ out vec3 FragPos;
 out vec3 Normal;
 
 uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
 
 void main()
 {
-    vec4 worldPos = model * vec4(aPos, 1.0);
+    vec3 position = DecodePosition(aPos);
+    vec4 worldPos = model * vec4(position, 1.0);
     FragPos = worldPos.xyz;
     // TexCoords = aTexCoords;
     
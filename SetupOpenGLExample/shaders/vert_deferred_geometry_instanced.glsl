@@ -0,0 +1,20 @@
+#version 410 core
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in vec3 aNormal;
+// Per-instance model matrix, occupies attribute locations 2 to 5
+layout (location = 2) in mat4 instanceModel;
+
+out vec3 FragPos;
+out vec3 Normal;
+
+void main()
+{
+    vec3 position = DecodePosition(aPos);
+    vec4 worldPos = instanceModel * vec4(position, 1.0);
+    FragPos = worldPos.xyz;
+    
+    mat3 normalMatrix = transpose(inverse(mat3(instanceModel)));
+    Normal = normalMatrix * aNormal;
+
+    gl_Position = projection * view * worldPos;
+}
@@ -0,0 +1,23 @@
+#version 410 core
+layout (location = 0) in vec3 aPos;
+
+uniform samplerBuffer lightPositions;   // xyz: position, w: influence radius
+
+// Scales the sphere mesh to unit radius, slightly inflated so the flat faces still enclose the sphere
+uniform float volumeScale;
+
+// Index of the first light, the stencil mode draws one light at a time
+uniform int lightOffset;
+
+flat out int lightIndex;
+
+void main()
+{
+    // One instance per light
+    lightIndex = lightOffset + gl_InstanceID;
+    vec4 light = texelFetch(lightPositions, lightIndex);
+    vec3 position = DecodePosition(aPos);
+    vec3 worldPos = light.xyz + position * volumeScale * light.w;
+    
+    gl_Position = projection * view * vec4(worldPos, 1.0);
+}
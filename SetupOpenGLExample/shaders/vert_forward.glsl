@@ -1,8 +1,6 @@
 #version 410 core
 
 uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
 
 layout(location=0) in vec3 inVertex;
 layout(location=1) in vec3 inNormal;
@@ -17,9 +15,10 @@ void main(void)
     // stage and the fragment shader will receive the interpolated
     // coordinates.
 
-    fragWorldPos = model * vec4(inVertex, 1);
+    vec3 position = DecodePosition(inVertex);
+    fragWorldPos = model * vec4(position, 1);
     fragWorldNor = inverse(transpose(mat3x3(model))) * inNormal;
 
-    gl_Position = projection * view * model * vec4(inVertex, 1);
+    gl_Position = projection * view * fragWorldPos;
 }
 
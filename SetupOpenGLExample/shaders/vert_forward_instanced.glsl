@@ -0,0 +1,22 @@
+#version 410 core
+
+layout(location=0) in vec3 inVertex;
+layout(location=1) in vec3 inNormal;
+// Per-instance model matrix, occupies attribute locations 2 to 5
+layout(location=2) in mat4 instanceModel;
+
+out vec4 fragWorldPos;
+out vec3 fragWorldNor;
+
+void main(void)
+{
+    // Same as vert_forward.glsl, but the model matrix comes from the
+    // instance buffer instead of a uniform, so a whole group of objects
+    // sharing a mesh is drawn with a single call.
+
+    vec3 position = DecodePosition(inVertex);
+    fragWorldPos = instanceModel * vec4(position, 1);
+    fragWorldNor = inverse(transpose(mat3x3(instanceModel))) * inNormal;
+
+    gl_Position = projection * view * fragWorldPos;
+}
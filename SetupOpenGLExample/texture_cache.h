@@ -0,0 +1,142 @@
+#pragma once
+
+// Cooked texture format, written by the asset cooker next to the image (doom-ground.jpg -> doom-ground.jpg.texcache).
+// Has no GL/GLM dependency.
+//
+// Layout: TextureCacheHeader, then every mip level from the largest down to 1x1, 8 bits per channel with
+// tightly packed rows (upload with GL_UNPACK_ALIGNMENT 1). Rows are stored bottom up like
+// stbi_set_flip_vertically_on_load(true) returns them. Uses the same source key as the mesh cache.
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "mesh_cache.h"
+
+const uint32_t textureCacheMagic = 0x58545244; // "DRTX"
+const uint32_t textureCacheVersion = 1;
+const int textureCacheMaxMips = 16;
+
+struct TextureCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    MeshCacheKey key;
+    uint32_t width;
+    uint32_t height;
+    uint32_t channels;
+    uint32_t mipCount;
+    uint64_t mipOffsets[textureCacheMaxMips];
+    uint64_t mipBytes[textureCacheMaxMips];
+};
+
+struct TextureCacheView {
+    const TextureCacheHeader* header = nullptr;
+    const char* data = nullptr;
+
+    uint32_t GetMipWidth(uint32_t mip) const {
+        auto width = header->width >> mip;
+        return width > 0 ? width : 1;
+    }
+
+    uint32_t GetMipHeight(uint32_t mip) const {
+        auto height = header->height >> mip;
+        return height > 0 ? height : 1;
+    }
+
+    const void* GetMipData(uint32_t mip) const {
+        return data + header->mipOffsets[mip];
+    }
+};
+
+inline std::string GetTextureCachePath(const std::string& sourcePath){
+    return sourcePath + ".texcache";
+}
+
+inline bool ReadTextureCache(const char* data, size_t size, const MeshCacheKey& key, TextureCacheView& view){
+    if(size < sizeof(TextureCacheHeader)){
+        return false;
+    }
+
+    auto header = (const TextureCacheHeader*)data;
+    if(header->magic != textureCacheMagic || header->version != textureCacheVersion ||
+       header->key.size != key.size || header->key.modifiedTime != key.modifiedTime || header->key.pathHash != key.pathHash){
+        return false;
+    }
+
+    if(header->mipCount == 0 || header->mipCount > (uint32_t)textureCacheMaxMips || header->channels == 0 || header->channels > 4){
+        return false;
+    }
+
+    view.header = header;
+    view.data = data;
+    for(uint32_t mip = 0; mip < header->mipCount; mip++){
+        auto expected = (uint64_t)view.GetMipWidth(mip) * view.GetMipHeight(mip) * header->channels;
+        if(header->mipBytes[mip] != expected || header->mipOffsets[mip] + expected > size){
+            return false;
+        }
+    }
+    return true;
+}
+
+// Halves one mip level with a 2x2 box filter, the last row/column of an odd size is repeated
+inline void DownsampleTextureMip(const uint8_t* source, uint32_t width, uint32_t height, uint32_t channels,
+                                 uint8_t* target, uint32_t targetWidth, uint32_t targetHeight){
+    for(uint32_t y = 0; y < targetHeight; y++){
+        auto y0 = y * 2 < height ? y * 2 : height - 1;
+        auto y1 = y * 2 + 1 < height ? y * 2 + 1 : height - 1;
+
+        for(uint32_t x = 0; x < targetWidth; x++){
+            auto x0 = x * 2 < width ? x * 2 : width - 1;
+            auto x1 = x * 2 + 1 < width ? x * 2 + 1 : width - 1;
+
+            for(uint32_t c = 0; c < channels; c++){
+                auto sum = source[(y0 * width + x0) * channels + c] + source[(y0 * width + x1) * channels + c] +
+                           source[(y1 * width + x0) * channels + c] + source[(y1 * width + x1) * channels + c];
+                target[(y * targetWidth + x) * channels + c] = (uint8_t)((sum + 2) / 4);
+            }
+        }
+    }
+}
+
+// Builds the cooked image with the full mip chain of a width x height texture
+inline bool BuildTextureCache(const uint8_t* pixels, uint32_t width, uint32_t height, uint32_t channels,
+                              const MeshCacheKey& key, std::vector<char>& image){
+    TextureCacheHeader header = {};
+    header.magic = textureCacheMagic;
+    header.version = textureCacheVersion;
+    header.key = key;
+    header.width = width;
+    header.height = height;
+    header.channels = channels;
+
+    auto size = width > height ? width : height;
+    while(size > 0){
+        header.mipCount++;
+        size >>= 1;
+    }
+    if(width == 0 || height == 0 || header.mipCount > (uint32_t)textureCacheMaxMips || channels == 0 || channels > 4){
+        return false;
+    }
+
+    TextureCacheView view = { &header, nullptr };
+    uint64_t offset = AlignMeshCacheOffset(sizeof(TextureCacheHeader));
+    for(uint32_t mip = 0; mip < header.mipCount; mip++){
+        header.mipOffsets[mip] = offset;
+        header.mipBytes[mip] = (uint64_t)view.GetMipWidth(mip) * view.GetMipHeight(mip) * channels;
+        offset = AlignMeshCacheOffset(offset + header.mipBytes[mip]);
+    }
+
+    image.assign(offset, 0);
+    memcpy(image.data() + header.mipOffsets[0], pixels, header.mipBytes[0]);
+
+    for(uint32_t mip = 1; mip < header.mipCount; mip++){
+        auto source = (const uint8_t*)image.data() + header.mipOffsets[mip - 1];
+        auto target = (uint8_t*)image.data() + header.mipOffsets[mip];
+        DownsampleTextureMip(source, view.GetMipWidth(mip - 1), view.GetMipHeight(mip - 1), channels,
+                             target, view.GetMipWidth(mip), view.GetMipHeight(mip));
+    }
+
+    memcpy(image.data(), &header, sizeof(header));
+    return true;
+}